@@ -11,42 +11,271 @@
 // - Continuous temperature sampling every 10 second
 // - Serial output for monitoring and debugging
 // - MQTT publishing of current temperature
+//
+// Task architecture:
+// - Acquisition task: sensor conversions, reads and discovery
+// - Network task: WiFi/MQTT connection handling and publishing
+// - Housekeeping task: periodic diagnostics
+// The tasks only communicate through fixed-size queues, so a blocking
+// network operation never delays sampling
+//
+// Battery mode (DEEP_SLEEP_MODE, esp32-c3-battery environment):
+// No tasks are started. Every wake runs a single cycle
+// convert -> connect -> publish -> deep sleep, with the state that has to
+// survive sleep kept in RTC memory
 
 #include <Arduino.h> // Core Arduino framework functions
 #include <OneWire.h> // Library for 1-Wire communication protocol
 #include <DallasTemperature.h> // Library for DS18B20 temperature sensor
 #include <PubSubClient.h> // Library for MQTT communication
 #include <WiFi.h> // Library for WiFi connectivity
+#include <freertos/FreeRTOS.h> // FreeRTOS kernel
+#include <freertos/task.h> // Tasks for acquisition, networking and housekeeping
+#include <freertos/queue.h> // Fixed-size queues between the tasks
+#include <freertos/semphr.h> // Mutex protecting the sensor table
+#include <esp_timer.h> // High resolution one-shot timer waking the acquisition task
+#include <esp_idf_version.h> // ESP-IDF version for API differences
+#include <esp_pm.h> // Power management, automatic light sleep
+#include <esp_wifi.h> // WiFi listen interval for modem sleep
+#include <esp_sleep.h> // Deep sleep for the battery mode
+#include <sys/time.h> // Wall clock for aligning the sample schedule
+#include <Preferences.h> // NVS storage for the WiFi fast reconnect cache
+#include <atomic> // Link state word shared between tasks and event handlers
+#include <LittleFS.h> // Flash overflow of the store-and-forward backlog
 
 #include "config.h" // WiFi and MQTT credentials
+#include "payload.h" // Compact binary payload format, shared with tools/
+
+// WiFi networks
+// A single network is taken from ssid/password in config.h. For devices
+// that move between sites define WIFI_NETWORKS in config.h instead, e.g.
+//   #define WIFI_NETWORKS {"office", "secret1"}, {"lab", "secret2"}
+// The last network connected to is tried first through the fast path,
+// then the configured networks found by one scan in order of RSSI, then
+// any not seen in the scan (hidden SSIDs) in the order listed
+struct WiFiNetwork
+{
+    const char* ssid;
+    const char* password;
+};
+
+#ifdef WIFI_NETWORKS
+const WiFiNetwork wifiNetworks[] = {WIFI_NETWORKS};
+#else
+const WiFiNetwork wifiNetworks[] = {{ssid, password}};
+#endif
+#define WIFI_NETWORK_COUNT (sizeof(wifiNetworks) / sizeof(wifiNetworks[0]))
 
 // OneWire bus pin configuration
+// One GPIO per OneWire bus, add pins to split long cable runs over
+// several independent buses
 // The DS18B20 sensor's data pin is connected to GPIO1
-#define ONE_WIRE_BUS 1
+const uint8_t oneWireBusPins[] = {1};
+#define ONE_WIRE_BUS_COUNT (sizeof(oneWireBusPins) / sizeof(oneWireBusPins[0]))
 
-// OneWire instance for communication with DS18B20 sensor
+// OneWire instances for communication with DS18B20 sensors, one per bus
 // Handles the low-level OneWire protocol communication
-OneWire oneWire(ONE_WIRE_BUS);
+OneWire oneWireBuses[ONE_WIRE_BUS_COUNT];
 
-// DallasTemperature instance for high-level sensor operations
+// DallasTemperature instances for high-level sensor operations, one per bus
 // Provides convenient methods for temperature reading and sensor management
-DallasTemperature sensors(&oneWire);
+DallasTemperature busSensors[ONE_WIRE_BUS_COUNT];
+
+// Second OneWire instance per bus used for hot-plug discovery
+// Same pins, but with its own ROM search state so a discovery pass spread
+// over many task iterations is not disturbed by alarm searches
+OneWire discoveryBuses[ONE_WIRE_BUS_COUNT];
 
-// Time interval between temperature samples in milliseconds
+// Default time interval between temperature samples in milliseconds
 // 10000ms = 10 second sampling rate
+// Individual sensors can use their own interval, see scheduleRules
 #define SAMPLE_INTERVAL 10000 // 10 second in milliseconds
 
+// Sensors that fall due within this window of a starting cycle are pulled
+// into it so they share the same broadcast Convert T
+#define SCHEDULE_COALESCE_WINDOW 500 // milliseconds
+
+// Wall clock alignment
+// Sample slots advance by exact multiples of the interval. Once SNTP has set
+// the clock the slots are placed on wall clock boundaries (a 10 second
+// interval samples at :00, :10, :20, ...) so readings of all devices line up
+#define NTP_SERVER "pool.ntp.org"
+#define WALL_CLOCK_VALID_EPOCH 1600000000 // Clock is not set before this time
+
+// Maximum number of DS18B20 sensors kept in the sensor table
+#define MAX_SENSORS 20
+
+// Adaptive resolution controller settings
+// Conversion time is 94ms at 9-bit, 188ms at 10-bit, 375ms at 11-bit
+// and 750ms at 12-bit
+#define RESOLUTION_MIN 9
+#define RESOLUTION_MAX 12
+
+// Temperature change between two samples in 1/16 °C treated as a fast change
+// A fast change drops the sensor to RESOLUTION_MIN
+#define RESOLUTION_FAST_DELTA 8 // 0.5°C
+
+// Number of consecutive stable samples before stepping up one bit
+#define RESOLUTION_STABLE_SAMPLES 3
+
+// Burst read settings
+// A burst samples all sensors at RESOLUTION_MIN and a short interval
+#define BURST_SAMPLE_COUNT 10
+#define BURST_SAMPLE_INTERVAL 250 // milliseconds
+
+// Hot-plug discovery settings
+// A discovery pass runs the ROM search on all buses every DISCOVERY_INTERVAL,
+// one search step (one device, ~14ms of bus time) per idle acquisition task iteration
+// so it never delays a sampling cycle by more than a single step
+#define DISCOVERY_INTERVAL 30000 // 30 seconds in milliseconds
+
+// Number of consecutive passes a sensor must be missing before removal
+#define DISCOVERY_MISSING_PASSES 2
+
+// Maximum number of new sensors initialized per pass
+// Initialization costs a scratchpad read and write, more sensors are
+// picked up by the following passes
+#define DISCOVERY_MAX_NEW_SENSORS 4
+
+// Alarm search fast path
+// When enabled every sensor's TH/TL alarm registers are programmed to a band
+// of ALARM_BAND °C around its last reading. Sample cycles then only read
+// and publish the sensors found by the OneWire alarm search, i.e. those
+// that left their band; all sensors are read every FULL_SWEEP_INTERVAL
+#define ALARM_SEARCH_MODE false
+#define ALARM_BAND 2                 // °C, whole degrees as TH/TL are 8-bit
+#define FULL_SWEEP_INTERVAL 300000   // 5 minutes in milliseconds
+
+// DS18B20 function commands and configuration register layout
+#define DS18B20_CMD_WRITE_SCRATCHPAD 0x4E
+#define DS18B20_CONFIG_RESERVED_BITS 0x1F
+
+// Factory default TH/TL, used when the alarm registers cannot be read
+#define DS18B20_DEFAULT_ALARM_HIGH 75
+#define DS18B20_DEFAULT_ALARM_LOW 70
+
+// DS18B20 power-on reset signature
+// The temperature register powers up as +85°C (0x0550) with the reserved
+// byte 6 at 0x0C; a real 85°C reading has byte 6 at 0x10
+#define DS18B20_POWER_ON_RAW 0x0550
+#define DS18B20_POWER_ON_BYTE6 0x0C
+
+// Valid DS18B20 measurement range in 1/16 °C
+#define DS18B20_RAW_MIN (-55 * 16)
+#define DS18B20_RAW_MAX (125 * 16)
+
+// Scratchpad read retries
+// A read is retried on CRC errors or a missing presence pulse, but never
+// more than READ_RETRY_LIMIT times or past READ_RETRY_BUDGET milliseconds
+// so a bad bus cannot stall the sampling cycle
+#define READ_RETRY_LIMIT 3
+#define READ_RETRY_BUDGET 30 // milliseconds per sensor
+
+// Interval for publishing the per-sensor diagnostics
+// (error counters and learned conversion times)
+#define DIAGNOSTICS_INTERVAL 60000 // 60 seconds in milliseconds
+
+// Hot path timing instrumentation
+// Build with -D TIMING_INSTRUMENTATION to keep a latency histogram per
+// stage, published on MQTT_TOPIC_TIMING/<stage> every DIAGNOSTICS_INTERVAL.
+// Without it the TIMING_* macros compile to nothing
+// Bucket b counts durations of 2^b to 2^(b+1)-1 microseconds, the last
+// bucket also counts everything longer
+#define TIMING_BUCKET_COUNT 24 // Up to ~8 seconds
+
+// Number of supported resolutions, RESOLUTION_MIN..RESOLUTION_MAX
+#define RESOLUTION_COUNT (RESOLUTION_MAX - RESOLUTION_MIN + 1)
+
 // MQTT Configuration
 #define MQTT_TOPIC_STATUS "esp32/status"
 #define MQTT_TOPIC_TEMPERATURE "sensor3/temp"
+#define MQTT_TOPIC_COMMAND "sensor3/cmd"
+#define MQTT_TOPIC_POWER "esp32/power"
+#define MQTT_TOPIC_BATTERY "esp32/battery"
+#define MQTT_TOPIC_TIMING "esp32/timing"
+#define MQTT_TOPIC_RECONNECT "esp32/reconnect"
+#define MQTT_TOPIC_TX_POWER "esp32/txpower"
+#define MQTT_TOPIC_BACKLOG "esp32/backlog"
+#define MQTT_TOPIC_BATCH "sensor3/batch"
+#define MQTT_TOPIC_BINARY "sensor3/bin"
+
+// Maximum MQTT topic length for per-sensor topics
+// MQTT_TOPIC_TEMPERATURE + "/" + 16 hex digits ROM address
+#define MQTT_TOPIC_MAX_LENGTH 64
 
 // MQTT Broker settings - replace with your broker details
 #define MQTT_PORT 1883
 
-// Timestamp of the last temperature sample in milliseconds
-// Used to maintain consistent sampling intervals
-// Prevents multiple samples within the same interval
-unsigned long lastSampleTime = 0;
+// Per-sensor sampling schedule rule
+// Matches sensors by ROM address prefix (hex digits as published in the
+// topic, "" matches any) and bus (-1 matches any)
+struct ScheduleRule
+{
+    const char* addressPrefix;  // Leading hex digits of the ROM address
+    int8_t bus;                 // Bus index or -1
+    unsigned long interval;     // Sampling interval in milliseconds
+    uint8_t maxResolution;      // Highest resolution the controller may use
+};
+
+// Sampling schedules, the first matching rule applies
+// Example: sample a process line probe every second at up to 11-bit
+//   {"28FF4A1B", -1, 1000, 11},
+// Example: sample everything on the second bus once a minute
+//   {"", 1, 60000, RESOLUTION_MAX},
+const ScheduleRule scheduleRules[] = {
+    {"", -1, SAMPLE_INTERVAL, RESOLUTION_MAX}, // Default for all other sensors
+};
+
+// Outcome of a validated scratchpad read
+enum ReadResult
+{
+    READ_OK,             // Valid temperature
+    READ_DISCONNECTED,   // No presence pulse or all-ones/all-zeros scratchpad
+    READ_CRC_ERROR,      // Scratchpad CRC mismatch
+    READ_POWER_ON_RESET, // Power-on 85°C value, the conversion did not run
+    READ_OUT_OF_RANGE    // Outside the -55..125°C measurement range
+};
+
+// Per-sensor error counters
+// Published on <topic>/errors every DIAGNOSTICS_INTERVAL
+struct SensorErrorCounters
+{
+    uint32_t disconnected;  // Reads that found no sensor
+    uint32_t crcErrors;     // Scratchpad CRC mismatches
+    uint32_t powerOnResets; // Power-on 85°C readings rejected
+    uint32_t outOfRange;    // Readings outside the measurement range
+    uint32_t retries;       // Read attempts beyond the first
+    uint32_t failedReads;   // Samples dropped after all retries
+    uint32_t skippedSlots;  // Sample slots missed by a late cycle
+};
+
+// Sensor table entry
+// Holds the ROM address found during enumeration so each sensor can be read
+// directly by address instead of searching the bus on every read
+struct TemperatureSensor
+{
+    DeviceAddress address;              // 64-bit ROM address
+    uint8_t bus;                        // Index of the OneWire bus the sensor is on
+    char topic[MQTT_TOPIC_MAX_LENGTH];  // MQTT topic for this sensor's readings
+    int8_t alarmHigh;                   // TH register
+    int8_t alarmLow;                    // TL register
+    uint8_t resolution;                 // Resolution currently programmed in bits
+    uint8_t stableSamples;              // Consecutive samples without fast change
+    bool hasLastTemp;                   // lastRaw holds a valid reading
+    int16_t lastRaw;                    // Previous reading in 1/16 °C
+    SensorErrorCounters errors;         // Read error accounting
+    uint16_t conversionTimes[RESOLUTION_COUNT]; // Learned conversion time per resolution in ms, 0 = unknown
+    unsigned long interval;             // Sampling interval from the schedule
+    uint8_t maxResolution;              // Resolution limit from the schedule
+    unsigned long nextSampleTime;       // Start of the next sample slot
+    bool due;                           // Sensor is sampled in the current cycle
+    bool selected;                      // Sensor is read in the current cycle
+    uint8_t missingPasses;              // Consecutive discovery passes without the sensor
+};
+
+// Table of sensors found on the bus in setup()
+TemperatureSensor sensorTable[MAX_SENSORS];
+uint8_t sensorCount = 0;
 
 // MQTT and WiFi connection management
 // WiFiClient provides the underlying TCP connection for MQTT
@@ -54,14 +283,484 @@ WiFiClient espClient;
 PubSubClient mqttClient(espClient);
 
 // Connection status tracking
-bool wifiConnected = false;
-bool mqttConnected = false;
-unsigned long lastReconnectAttempt = 0;
+// Link state word: the WiFi event handler posts event bits, the network
+// task consumes them and maintains the up bits, every task can read it
+// without touching the WiFi driver or the MQTT client
+#define LINK_WIFI_UP (1u << 0)      // Associated and got an IP address
+#define LINK_MQTT_UP (1u << 1)      // MQTT session established
+#define LINK_EVENT_GOT_IP (1u << 2) // Event: got an IP address
+#define LINK_EVENT_LOST (1u << 3)   // Event: association or IP address lost
+#define LINK_EVENT_SCAN_DONE (1u << 4) // Event: WiFi scan completed
+#define LINK_EVENTS (LINK_EVENT_GOT_IP | LINK_EVENT_LOST | LINK_EVENT_SCAN_DONE)
+
+std::atomic<uint32_t> linkState(0);
+unsigned long mqttRetryTime = 0;
 unsigned long lastMqttPublish = 0;
+unsigned long lastDiagnosticsReport = 0;
+
+// Reconnect backoff in milliseconds
+// Failed WiFi and MQTT attempts are retried after an exponentially growing
+// delay, reset on success. Each delay is randomized between half and the
+// full backoff so a fleet that lost its broker or access point at the same
+// moment does not reconnect in synchronized waves
+#define RECONNECT_BACKOFF_MIN 2000
+#define RECONNECT_BACKOFF_MAX 300000 // 5 minutes
+
+// Reconnect backoff state and statistics for one connection
+// Published on MQTT_TOPIC_RECONNECT/<connection> every DIAGNOSTICS_INTERVAL
+struct ReconnectBackoff
+{
+    unsigned long backoff;          // Current backoff before jitter
+    uint32_t attempts;              // Connection attempts since boot
+    uint32_t failures;              // Failed attempts since boot
+    uint32_t consecutiveFailures;   // Failed attempts since the last success
+    uint32_t lastDuration;          // Duration of the last attempt in milliseconds
+    uint32_t maxDuration;           // Longest attempt in milliseconds
+};
+
+ReconnectBackoff wifiBackoff = {RECONNECT_BACKOFF_MIN, 0, 0, 0, 0, 0};
+ReconnectBackoff mqttBackoff = {RECONNECT_BACKOFF_MIN, 0, 0, 0, 0, 0};
+
+// WiFi connection
+// The last good access point (BSSID, channel) and DHCP lease are cached and
+// tried first: no scan and no DHCP, which brings association plus IP down
+// to a few hundred milliseconds. The lease is reused as a static address,
+// so give the device a DHCP reservation. If the fast path has not connected
+// within WIFI_FAST_CONNECT_TIMEOUT the cache is dropped and a full scan
+// with DHCP is done
+#define WIFI_CONNECT_TIMEOUT 10000     // Connection attempt per network in milliseconds
+#define WIFI_FAST_CONNECT_TIMEOUT 1500 // Fast path attempt in milliseconds
+#define WIFI_SCAN_TIMEOUT 5000         // Scan for the configured networks in milliseconds
+#define WIFI_CACHE_MAGIC 0x57494649    // Marks a valid cache ("WIFI")
+
+// Adaptive TX power
+// While connected the TX power is stepped down while the RSSI stays above
+// TX_POWER_RSSI_HIGH without publish failures, and stepped up when it drops
+// below TX_POWER_RSSI_LOW, a publish fails or the link is lost. The RSSI of
+// the AP's frames stands in for the path loss of our own transmissions
+// The supermini's antenna reflection problem makes it fail above 8.5 dBm,
+// so the controller never goes above that by default. Boards with a good
+// antenna can opt in to more in build_flags, e.g.
+//   -D TX_POWER_MAX=WIFI_POWER_13dBm
+#define TX_POWER_MIN WIFI_POWER_2dBm
+#ifndef TX_POWER_MAX
+#define TX_POWER_MAX WIFI_POWER_8_5dBm
+#endif
+#ifndef TX_POWER_START
+#define TX_POWER_START WIFI_POWER_8_5dBm
+#endif
+#define TX_POWER_RSSI_LOW -75           // dBm
+#define TX_POWER_RSSI_HIGH -60          // dBm
+#define TX_POWER_ADJUST_INTERVAL 10000  // milliseconds between controller steps
+#define TX_POWER_STABLE_PERIODS 3       // Good intervals before stepping down
+
+// FreeRTOS task configuration
+// Acquisition runs at the highest priority so sampling stays on schedule
+// whatever the network is doing; housekeeping runs below networking
+#define ACQUISITION_TASK_PRIORITY 3
+#define NETWORK_TASK_PRIORITY 2
+#define HOUSEKEEPING_TASK_PRIORITY 1
+#define ACQUISITION_TASK_STACK 4096 // bytes
+#define NETWORK_TASK_STACK 8192     // bytes
+#define HOUSEKEEPING_TASK_STACK 4096 // bytes
+
+// Task wakeup timing in milliseconds
+// The tasks sleep until their next deadline instead of polling:
+// - the acquisition task is woken by a one-shot esp_timer at the next sample,
+//   poll window or discovery step, or by a command notification
+// - the network task is woken by queued data or, while connected, at least
+//   every NETWORK_POLL_INTERVAL to read incoming MQTT data and keep alive
+// - the housekeeping task sleeps until the next diagnostics report
+#define ACQUISITION_STEP_INTERVAL 1  // Between reads, lets lower priority tasks run
+#define CONVERSION_POLL_INTERVAL 5   // Between completion polls of a converting bus
+#define DISCOVERY_STEP_INTERVAL 20   // Between discovery search steps
+#define NETWORK_POLL_INTERVAL 250
+#define HOUSEKEEPING_RETRY_INTERVAL 1000 // Recheck while MQTT is down
+
+// Power saving mode
+// Enables automatic light sleep between task wakeups, WiFi modem sleep with
+// WIFI_LISTEN_INTERVAL and frequency scaling between CPU_MIN_FREQ_MHZ and
+// CPU_MAX_FREQ_MHZ. The MQTT session stays up: the AP buffers traffic and
+// the network task keeps sending keepalives.
+// Requires CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE, which
+// the prebuilt Arduino libraries lack, otherwise the device stays awake and
+// logs why. The esp32-c3-powersave environment builds Arduino as an ESP-IDF
+// component with sdkconfig.defaults enabling both, plus CONFIG_PM_PROFILING
+// for measuring the time actually spent in light sleep
+#ifndef POWER_SAVE_MODE
+#define POWER_SAVE_MODE false
+#endif
+#define WIFI_LISTEN_INTERVAL 3 // Beacon intervals between wakeups in modem sleep
+#define CPU_MAX_FREQ_MHZ 160
+#define CPU_MIN_FREQ_MHZ 40
+
+// Deep sleep battery mode
+// Enabled with -D DEEP_SLEEP_MODE, see the esp32-c3-battery environment in
+// platformio.ini. All sensors are sampled once per wake
+#define DEEP_SLEEP_INTERVAL 300000 // 5 minutes in milliseconds between wakes
+#define DEEP_SLEEP_MIN_SLEEP 1000  // Shortest sleep when a cycle overruns
+#define RTC_PENDING_SAMPLES 32     // Unpublished readings kept across wakes
+#define RTC_STATE_MAGIC 0x54454D50 // Marks initialized RTC state ("TEMP")
+
+// Queue lengths
+// Readings waiting to be published, queued MQTT messages (diagnostics
+// and reports) and commands from MQTT to the acquisition task
+#define SAMPLE_QUEUE_LENGTH 64
+#define MESSAGE_QUEUE_LENGTH 16
+#define COMMAND_QUEUE_LENGTH 4
+
+// MQTT payload buffer size for queued messages
+#define MQTT_PAYLOAD_MAX_LENGTH 160
+
+// Store-and-forward backlog
+// Readings taken while MQTT is down are kept in a RAM ring and published
+// after the reconnect on <topic>/history with their original time. The
+// backlog is drained in small batches so live readings are never delayed
+// With BACKLOG_FLASH_OVERFLOW readings that do not fit the ring go to a
+// LittleFS file, otherwise the oldest reading is dropped. The file only
+// bridges long outages, it is cleared on boot as the timestamps are
+// relative to millis()
+#define BACKLOG_LENGTH 512            // Readings, 16 bytes each
+#define BACKLOG_DRAIN_BATCH 8         // Readings per drain step
+#define BACKLOG_DRAIN_INTERVAL 500    // milliseconds between drain steps
+#define BACKLOG_FLASH_OVERFLOW false
+#define BACKLOG_FILE "/backlog.bin"
+#define BACKLOG_FILE_MAX_SAMPLES 16384 // 256 KB, newer readings are dropped beyond
+
+// Batched publishing
+// With BATCH_MODE the live readings of all sensors are collected and sent
+// as one message on MQTT_TOPIC_BATCH once BATCH_MAX_SAMPLES readings are
+// collected or the oldest is BATCH_MAX_LATENCY old, instead of paying the
+// TCP/IP and radio overhead per reading. The backlog drains in batches too
+#define BATCH_MODE false
+#define BATCH_MAX_SAMPLES 16
+#define BATCH_MAX_LATENCY 30000       // milliseconds
+#define BATCH_ENTRY_MAX_LENGTH 48     // ["<ROM>",-55.0,12,<offset>],
+#define BATCH_PAYLOAD_MAX_LENGTH (64 + BATCH_MAX_SAMPLES * BATCH_ENTRY_MAX_LENGTH)
+// MQTT client buffer: payload, topic and packet header
+#define BATCH_BUFFER_SIZE (BATCH_PAYLOAD_MAX_LENGTH + MQTT_TOPIC_MAX_LENGTH + 8)
+
+// Compact binary payload
+// With BINARY_PAYLOAD all readings, single, batched or from the backlog,
+// are published on MQTT_TOPIC_BINARY in the format of payload.h instead
+// of text and JSON: 11 bytes per message plus 15 bytes per reading,
+// carrying the sensor, time, raw value and resolution. tools/ has a
+// decoder for Linux
+#define BINARY_PAYLOAD false
+#define BINARY_PAYLOAD_MAX_LENGTH (PAYLOAD_HEADER_SIZE + BATCH_MAX_SAMPLES * PAYLOAD_RECORD_SIZE)
+
+// Reading passed from the acquisition task to the network task
+struct TemperatureSample
+{
+    DeviceAddress address;  // ROM address of the sensor
+    uint32_t timestamp;     // millis() at the start of the conversion
+    int16_t raw;            // Temperature in 1/16 °C
+    uint8_t resolution;     // Resolution of the reading in bits
+};
+
+// MQTT message queued for the network task
+struct MqttMessage
+{
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    bool retained;
+};
+
+// Commands passed from the MQTT callback to the acquisition task
+enum AcquisitionCommand : uint8_t
+{
+    CMD_BURST // Start a burst read
+};
+
+// Queues between the tasks
+QueueHandle_t sampleQueue;
+QueueHandle_t messageQueue;
+QueueHandle_t commandQueue;
+
+// Store-and-forward backlog, owned by the network task
+// The ring holds the oldest readings; once readings overflow to flash
+// later ones are appended to the file as well to keep them in order
+TemperatureSample backlog[BACKLOG_LENGTH];
+uint16_t backlogHead = 0;          // Oldest reading in the ring
+uint16_t backlogCount = 0;         // Readings in the ring
+bool backlogFlashReady = false;    // LittleFS mounted for the overflow
+uint32_t backlogFileRead = 0;      // Readings already moved back from the file
+uint32_t backlogFileCount = 0;     // Readings still in the file
+uint32_t backlogDrained = 0;       // Readings published from the backlog
+uint32_t backlogDropped = 0;       // Readings lost to a full backlog
+unsigned long lastBacklogDrain = 0;
+
+// Live readings collected for the next batch, owned by the network task
+TemperatureSample batch[BATCH_MAX_SAMPLES];
+uint8_t batchCount = 0;
+
+// Protects the sensor table against a discovery update while another task
+// reads it; the acquisition task owns the table and may read it unlocked
+SemaphoreHandle_t sensorTableMutex;
+
+// Presence topics of removed sensors whose retained "absent" has not been
+// published yet, kept with the table under sensorTableMutex until the
+// network task has sent them, so removals while offline are not lost
+char absentTopics[MAX_SENSORS][MQTT_TOPIC_MAX_LENGTH];
+uint8_t absentCount = 0;
+std::atomic<bool> presenceChanged(false); // Table changed since the last announcement
+
+// Task handles used for wakeup notifications
+TaskHandle_t acquisitionTaskHandle = NULL;
+TaskHandle_t networkTaskHandle = NULL;
+
+// One-shot timer that wakes the acquisition task at its next deadline
+esp_timer_handle_t acquisitionTimer;
 
-// MQTT reconnection interval in milliseconds
-// Prevents excessive reconnection attempts
-#define MQTT_RECONNECT_INTERVAL 5000
+// Busy time accounting
+// The time with at least one firmware task running. The device cannot
+// light sleep then, but it may also stay awake while all tasks wait (WiFi
+// driver, locks), so this is not the sleep time; that is measured from the
+// power management statistics
+portMUX_TYPE awakeMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t awakeTasks = 0;          // Number of tasks currently running
+int64_t awakeSince = 0;          // Start of the current awake period in us
+int64_t awakeTime = 0;           // Awake time in the current report period in us
+int64_t awakeReportStart = 0;    // Start of the current report period in us
+
+// Keeps the CPU at full speed while the acquisition task bit-bangs the bus
+esp_pm_lock_handle_t acquisitionPmLock = NULL;
+
+// Temperature acquisition state machine
+// The DS18B20 conversion is started in one acquisition task iteration and
+// harvested in later ones, so the task never blocks for the 94-750ms
+// conversion time
+enum AcquisitionState
+{
+    ACQ_IDLE,      // Waiting for the next sample interval
+    ACQ_CONVERTING // Conversions running or results being read
+};
+
+AcquisitionState acquisitionState = ACQ_IDLE;
+
+// Per-bus acquisition state
+// All buses convert at the same time; reads are interleaved across the
+// buses one sensor per acquisition task iteration
+// Completion is detected by polling the read time slot: sensors hold the
+// bus low while converting. Polling starts shortly before the learned
+// conversion time, the datasheet time is only used as a timeout
+struct OneWireBusState
+{
+    unsigned long conversionTime; // Datasheet worst case for the slowest sensor, timeout
+    unsigned long pollStartTime;  // Earliest time to start polling for completion
+    uint8_t resolution;           // Highest resolution converting on the bus
+    uint8_t nextSensor;           // Sensor table index to continue reading from
+    bool parasitePower;           // Parasite powered buses cannot be polled
+    bool converted;               // Conversion on this bus has completed
+    bool alarmSearchDone;         // Alarm search has finished or is not needed
+    bool pending;                 // Bus still has sensors to read this cycle
+};
+
+OneWireBusState busStates[ONE_WIRE_BUS_COUNT];
+
+// Timestamp when the current conversions were started in milliseconds
+unsigned long conversionStartTime = 0;
+
+// Bus that was read last, the next read starts at the bus after it
+uint8_t lastReadBus = 0;
+
+// Hot-plug discovery pass state
+// Addresses found in the current pass are collected here and applied to
+// the sensor table in one step when the pass completes
+struct DiscoveryState
+{
+    bool active;                        // Pass in progress
+    bool overflow;                      // More sensors found than fit the list
+    uint8_t bus;                        // Bus currently being searched
+    uint8_t foundCount;                 // Number of entries in found
+    DeviceAddress found[MAX_SENSORS];   // Addresses found in this pass
+    uint8_t foundBus[MAX_SENSORS];      // Bus of each found address
+};
+
+DiscoveryState discovery;
+unsigned long lastDiscoveryTime = 0;
+
+// Timestamp of the last full sweep in alarm search mode
+// The first cycle after boot is always a full sweep
+unsigned long lastFullSweepTime = 0;
+bool fullSweepDone = false;
+
+// Remaining samples of a burst read requested over MQTT
+// While non-zero all sensors run at RESOLUTION_MIN and BURST_SAMPLE_INTERVAL
+uint8_t burstSamplesRemaining = 0;
+unsigned long lastBurstSampleTime = 0;
+
+// WiFi connection state machine
+// Advanced by the network task on WiFi events and timeouts, so a missing
+// or flaky access point never blocks and never restarts the device
+enum WiFiState
+{
+    WIFI_STATE_DISCONNECTED, // Waiting for the next attempt
+    WIFI_STATE_SCANNING,     // Scanning for the configured networks
+    WIFI_STATE_CONNECTING,   // Connecting to one network
+    WIFI_STATE_CONNECTED     // Associated and got an IP address
+};
+
+// Network to try in a connection attempt, ranked by the scan
+struct WiFiCandidate
+{
+    uint8_t network;    // Index into wifiNetworks
+    uint8_t bssid[6];   // Strongest access point of the network
+    int32_t channel;    // Channel of that access point, 0 = not seen in the scan
+    int8_t rssi;        // Signal strength in the scan
+};
+
+WiFiState wifiState = WIFI_STATE_DISCONNECTED;
+bool wifiFastPath = false;          // Connecting through the cached connection
+std::atomic<uint8_t> wifiNetwork(0); // Network being connected to or connected
+unsigned long wifiAttemptStart = 0; // Start of the current attempt
+unsigned long wifiStepStart = 0;    // Start of the current scan or network
+unsigned long wifiRetryTime = 0;    // Earliest start of the next attempt
+WiFiCandidate wifiCandidates[WIFI_NETWORK_COUNT];
+uint8_t wifiCandidateCount = 0;
+uint8_t wifiCandidateIndex = 0;     // Candidate being connected to
+
+// Last good WiFi connection for the fast reconnect path
+// Kept in RTC memory across deep sleep and in NVS across power loss
+struct WiFiCache
+{
+    uint32_t magic;     // WIFI_CACHE_MAGIC when valid
+    char ssid[33];      // Network, looked up in wifiNetworks for the password
+    uint8_t bssid[6];   // Access point
+    int32_t channel;    // WiFi channel of the access point
+    uint32_t ip;        // DHCP lease and network configuration
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+};
+
+RTC_DATA_ATTR WiFiCache wifiCache;
+Preferences preferences;
+
+// Supported TX power levels, lowest first
+const wifi_power_t txPowerLevels[] = {
+    WIFI_POWER_MINUS_1dBm, WIFI_POWER_2dBm, WIFI_POWER_5dBm, WIFI_POWER_7dBm,
+    WIFI_POWER_8_5dBm, WIFI_POWER_11dBm, WIFI_POWER_13dBm, WIFI_POWER_15dBm,
+    WIFI_POWER_17dBm, WIFI_POWER_18_5dBm, WIFI_POWER_19dBm, WIFI_POWER_19_5dBm};
+#define TX_POWER_LEVEL_COUNT (sizeof(txPowerLevels) / sizeof(txPowerLevels[0]))
+
+// TX power controller state, owned by the network task
+static_assert(TX_POWER_START >= TX_POWER_MIN && TX_POWER_START <= TX_POWER_MAX,
+              "TX_POWER_START must be within TX_POWER_MIN..TX_POWER_MAX");
+wifi_power_t txPower = TX_POWER_START;  // Power used for the next connection
+unsigned long lastTxPowerAdjust = 0;    // Last controller step
+uint8_t txPowerStablePeriods = 0;       // Consecutive intervals with a strong link
+int8_t txPowerRssi = 0;                 // RSSI at the last controller step
+uint32_t publishFailures = 0;           // Failed publishes since the last step
+
+#ifdef TIMING_INSTRUMENTATION
+// Instrumented stages
+enum TimingStage
+{
+    STAGE_CONVERSION,   // Convert T until the bus reports completion
+    STAGE_READ,         // Scratchpad read including retries
+    STAGE_FORMAT,       // Formatting a reading for publishing
+    STAGE_PUBLISH,      // Handing a reading to the MQTT client, a blocking TCP write
+    STAGE_WIFI_CONNECT, // WiFi (re)connection
+    STAGE_MQTT_CONNECT, // MQTT (re)connection
+    STAGE_COUNT
+};
+
+const char* const timingStageNames[STAGE_COUNT] = {
+    "conversion", "read", "format", "publish", "wifiConnect", "mqttConnect"};
+
+// Latency histogram of one stage
+struct TimingHistogram
+{
+    uint32_t count;                         // Recorded durations
+    uint32_t maxTime;                       // Longest duration in microseconds
+    uint32_t buckets[TIMING_BUCKET_COUNT];  // Power of two microsecond buckets
+};
+
+// Stages are recorded by the acquisition and network tasks and reported
+// and reset by the housekeeping task
+TimingHistogram timingHistograms[STAGE_COUNT];
+portMUX_TYPE timingMux = portMUX_INITIALIZER_UNLOCKED;
+
+//
+// Record one duration of a stage in microseconds
+//
+void recordTiming(TimingStage stage, uint32_t time)
+{
+    uint8_t bucket = time < 2 ? 0 : 31 - __builtin_clz(time);
+    if (bucket >= TIMING_BUCKET_COUNT)
+    {
+        bucket = TIMING_BUCKET_COUNT - 1;
+    }
+
+    portENTER_CRITICAL(&timingMux);
+    TimingHistogram& histogram = timingHistograms[stage];
+    histogram.count++;
+    histogram.buckets[bucket]++;
+    if (time > histogram.maxTime)
+    {
+        histogram.maxTime = time;
+    }
+    portEXIT_CRITICAL(&timingMux);
+}
+
+// Short stages are timed with the CPU cycle counter, stages that block or
+// may span a light sleep with the microsecond timer
+#define TIMING_CYCLES_BEGIN(start) uint32_t start = ESP.getCycleCount()
+#define TIMING_CYCLES_END(stage, start) recordTiming(stage, (ESP.getCycleCount() - start) / ESP.getCpuFreqMHz())
+#define TIMING_MICROS_BEGIN(start) int64_t start = esp_timer_get_time()
+#define TIMING_MICROS_END(stage, start) recordTiming(stage, (uint32_t)(esp_timer_get_time() - start))
+#define TIMING_RECORD(stage, time) recordTiming(stage, time)
+#else
+#define TIMING_CYCLES_BEGIN(start)
+#define TIMING_CYCLES_END(stage, start)
+#define TIMING_MICROS_BEGIN(start)
+#define TIMING_MICROS_END(stage, start)
+#define TIMING_RECORD(stage, time)
+#endif
+
+#ifdef DEEP_SLEEP_MODE
+// State retained in RTC memory across deep sleep
+// Lost on power-on or reset, detected by the magic value
+struct RtcState
+{
+    uint32_t magic;                 // RTC_STATE_MAGIC once initialized
+    uint32_t wakeCount;             // Wakes since power-on
+    uint32_t clock;                 // Milliseconds since power-on at this wake
+    uint32_t samplesTaken;          // Readings taken since power-on
+    uint32_t samplesPublished;      // Readings published since power-on
+    uint32_t samplesDropped;        // Readings lost to a full pending buffer
+    uint8_t pendingCount;           // Readings waiting to be published
+    TemperatureSample pending[RTC_PENDING_SAMPLES]; // Oldest first, timestamps from power-on
+    uint8_t sensorCount;            // Entries in sensors
+    TemperatureSensor sensors[MAX_SENSORS]; // Sensor table with the learned resolution and timing
+};
+
+RTC_DATA_ATTR RtcState rtcState;
+#endif
+
+//
+// Check a bit of the link state word
+//
+bool isLinkUp(uint32_t flag)
+{
+    return (linkState.load() & flag) != 0;
+}
+
+//
+// Set or clear a bit of the link state word
+//
+void setLinkFlag(uint32_t flag, bool set)
+{
+    if (set)
+    {
+        linkState.fetch_or(flag);
+    }
+    else
+    {
+        linkState.fetch_and(~flag);
+    }
+}
 
 // MQTT callback function for incoming messages
 // This function is called when a message is received on a subscribed topic
@@ -80,254 +779,2940 @@ void mqttCallback(char* topic, byte* payload, unsigned int length)
     Serial.print("]: ");
     Serial.println(message);
 
-    // Handle different topics if needed
-    // Currently just logs the message, but could be extended for remote control
+    // Handle remote control commands
+    // "burst" starts a burst of fast low-resolution samples
+    if (strcmp(topic, MQTT_TOPIC_COMMAND) == 0 && length == 5 && memcmp(payload, "burst", 5) == 0)
+    {
+        AcquisitionCommand command = CMD_BURST;
+        xQueueSend(commandQueue, &command, 0);
+        if (acquisitionTaskHandle != NULL)
+        {
+            xTaskNotifyGive(acquisitionTaskHandle);
+        }
+        Serial.println("Burst read requested");
+    }
 }
 
 //
-// Connect to WiFi network
-// Returns true if connection is successful, retry otherwise
+// Mark a task as running
+// Called when a task wakes up, paired with markTaskAsleep()
 //
-bool connectToWiFi()
+void markTaskAwake()
 {
-    // Init WiFI
-	WiFi.enableAP(false);
-    WiFi.mode(WIFI_STA);
-    // Reduce power for supermini antenna reflection
-    WiFi.setTxPower(WIFI_POWER_8_5dBm);
-    // WiFi connect
-    WiFi.begin(ssid, password);
-    // reduce power for supermini antenna problem
-    // wait 10 S before reboot
-    int trying = 10;
-    while (WiFi.status() != WL_CONNECTED)
+    portENTER_CRITICAL(&awakeMux);
+    if (awakeTasks++ == 0)
     {
-        Serial.print(".");
-        delay(1000);
-        if (trying == 0)
-            ESP.restart();
-        else
-            trying--;
+        awakeSince = esp_timer_get_time();
     }
-    return true;
+    portEXIT_CRITICAL(&awakeMux);
 }
 
 //
-// Connect to MQTT broker
-// Returns true if connection is successful, false otherwise
+// Mark a task as going to sleep
+// Called right before a task blocks waiting for its next deadline
 //
-bool connectToMQTT()
+void markTaskAsleep()
 {
-    // Set MQTT server details
-    mqttClient.setServer(mqtt_server, MQTT_PORT);
-    mqttClient.setCallback(mqttCallback);
+    portENTER_CRITICAL(&awakeMux);
+    if (awakeTasks > 0 && --awakeTasks == 0)
+    {
+        awakeTime += esp_timer_get_time() - awakeSince;
+    }
+    portEXIT_CRITICAL(&awakeMux);
+}
 
-    Serial.print("Connecting to MQTT broker ");
-    Serial.print(mqtt_server);
-    Serial.print(":");
-    Serial.print(MQTT_PORT);
+//
+// Enable automatic light sleep and frequency scaling
+// Logs the reason if the framework was built without power management
+//
+void configurePowerSaving()
+{
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_pm_config_t pmConfig = {};
+#else
+    esp_pm_config_esp32c3_t pmConfig = {};
+#endif
+    pmConfig.max_freq_mhz = CPU_MAX_FREQ_MHZ;
+    pmConfig.min_freq_mhz = CPU_MIN_FREQ_MHZ;
+    pmConfig.light_sleep_enable = true;
 
-    // Attempt to connect with client ID
-    if (mqttClient.connect(mqtt_server))
+    esp_err_t result = esp_pm_configure(&pmConfig);
+    if (result != ESP_OK)
     {
-        Serial.println("\nMQTT connected!");
+        Serial.print("Light sleep not available: ");
+        Serial.println(esp_err_to_name(result));
+        return;
+    }
 
-        // Publish online status
-        mqttClient.publish(MQTT_TOPIC_STATUS, "online");
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "acquisition", &acquisitionPmLock);
+    Serial.println("Automatic light sleep enabled");
+}
+
+//
+// Enable WiFi modem sleep with the configured listen interval
+// Must be called before connecting, the listen interval is sent in the
+// association request
+//
+void configureModemSleep()
+{
+    WiFi.setSleep(WIFI_PS_MAX_MODEM);
 
-        // Subscribe to topics if needed
-        // mqttClient.subscribe("your/control/topic");
+    wifi_config_t config;
+    esp_wifi_get_config(WIFI_IF_STA, &config);
+    config.sta.listen_interval = WIFI_LISTEN_INTERVAL;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+}
 
-        mqttConnected = true;
-        return true;
+//
+// Randomized delay before the next attempt, doubles the backoff
+// Returns a delay between half and the full current backoff
+//
+unsigned long nextBackoffDelay(ReconnectBackoff& state)
+{
+    unsigned long backoff = state.backoff;
+    state.backoff = min(backoff * 2, (unsigned long)RECONNECT_BACKOFF_MAX);
+    return backoff / 2 + esp_random() % (backoff / 2 + 1);
+}
+
+//
+// Record the outcome of a connection attempt
+// Success resets the backoff
+//
+void recordReconnectAttempt(ReconnectBackoff& state, bool success, unsigned long duration)
+{
+    state.attempts++;
+    state.lastDuration = duration;
+    state.maxDuration = max(state.maxDuration, (uint32_t)duration);
+    if (success)
+    {
+        state.backoff = RECONNECT_BACKOFF_MIN;
+        state.consecutiveFailures = 0;
     }
     else
     {
-        Serial.println("\nMQTT connection failed!");
-        Serial.print("Error code: ");
-        Serial.println(mqttClient.state());
-        mqttConnected = false;
-        return false;
+        state.failures++;
+        state.consecutiveFailures++;
     }
 }
 
 //
-// Publish temperature data to MQTT broker
-// Publishes current temperature
+// Start SNTP once a network connection is up
+// The clock keeps running through reconnects and deep sleep, SNTP
+// corrects it in the background
 //
-void publishTemperatureData(float currentTemp)
+void startTimeSync()
 {
-    char payload[20]; // Buffer for payload strings
-
-    // Publish current temperature
-    dtostrf(currentTemp, 6, 1, payload);
-    mqttClient.publish(MQTT_TOPIC_TEMPERATURE, payload);
-
-    // Log published temperature
-    Serial.print("Published to MQTT: ");
-    Serial.print(payload);
-    Serial.println(" C");
+    static bool started = false;
+    if (!started)
+    {
+        configTime(0, 0, NTP_SERVER);
+        started = true;
+    }
 }
 
 //
-// Maintain MQTT connection and handle reconnections
+// Wall clock time for a millis() timestamp in milliseconds since the epoch
+// Returns false while the clock has not been set by SNTP
 //
-void handleMQTTConnection()
+bool wallClockAt(unsigned long time, uint64_t& wallTime)
 {
-    unsigned long currentTime = millis();
-
-    // Check if WiFi is still connected
-    if (WiFi.status() != WL_CONNECTED)
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < WALL_CLOCK_VALID_EPOCH)
     {
-        wifiConnected = false;
-        mqttConnected = false;
-        Serial.println("WiFi disconnected!");
+        return false;
+    }
+    uint64_t nowMs = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    wallTime = nowMs - (millis() - time);
+    return true;
+}
 
-        // Attempt to reconnect to WiFi
-        if (connectToWiFi())
-        {
-            // WiFi reconnected, now try MQTT
-            connectToMQTT();
-        }
+//
+// Load the WiFi fast reconnect cache
+// RTC memory is used after deep sleep, NVS after a power-on
+//
+void loadWiFiCache()
+{
+    if (wifiCache.magic == WIFI_CACHE_MAGIC)
+    {
         return;
     }
 
-    // Check if MQTT is connected
-    if (!mqttClient.connected())
+    preferences.begin("wifi", true);
+    if (preferences.getBytes("cache", &wifiCache, sizeof(wifiCache)) != sizeof(wifiCache) ||
+        wifiCache.magic != WIFI_CACHE_MAGIC)
     {
-        mqttConnected = false;
+        memset(&wifiCache, 0, sizeof(wifiCache));
+    }
+    preferences.end();
+}
 
-        // Check if enough time has passed since last reconnection attempt
-        if (currentTime - lastReconnectAttempt > MQTT_RECONNECT_INTERVAL)
-        {
-            lastReconnectAttempt = currentTime;
+//
+// Save the current connection as the WiFi fast reconnect cache
+// NVS is only written when the connection differs from the cached one
+//
+void saveWiFiCache()
+{
+    WiFiCache cache = {};
+    cache.magic = WIFI_CACHE_MAGIC;
+    strncpy(cache.ssid, wifiNetworks[wifiNetwork].ssid, sizeof(cache.ssid) - 1);
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.channel = WiFi.channel();
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.subnet = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
 
-            Serial.println("Attempting MQTT reconnection...");
-            if (connectToMQTT())
-            {
-                Serial.println("MQTT reconnected successfully!");
-            }
-        }
-    }
-    else
+    if (memcmp(&cache, &wifiCache, sizeof(cache)) == 0)
     {
-        // MQTT is connected, process any incoming messages
-        mqttClient.loop();
+        return;
     }
+    wifiCache = cache;
+
+    preferences.begin("wifi", false);
+    preferences.putBytes("cache", &wifiCache, sizeof(wifiCache));
+    preferences.end();
 }
 
 //
-// Arduino setup function - runs once at startup
+// Switch the radio to station mode with the current TX power
 //
-// Initializes all hardware components and prepares the system
-// for temperature monitoring operations.
+void prepareWiFi()
+{
+    // Init WiFI
+	WiFi.enableAP(false);
+    WiFi.persistent(false);
+    WiFi.mode(WIFI_STA);
+    // Start at the power the controller settled on
+    WiFi.setTxPower(txPower);
+}
+
 //
-// Initialization sequence:
-// 1. Configure serial communication for debugging/output
-// 2. Initialize the DallasTemperature library
-// 3. Verify sensor connection and readiness
+// Start connecting to a network without waiting
+// A known channel and BSSID skip the driver's scan. The fast path also
+// reuses the cached lease, otherwise DHCP is used
 //
-void setup(void)
+void beginWiFi(uint8_t network, int32_t channel, const uint8_t* bssid, bool fastPath)
 {
-    // Initialize serial communication at 115200 baud
-    // This allows for high-speed data transfer to serial monitor
-    // 115200 is a common baud rate for ESP32 debugging
-    Serial.begin(115200);
-
-    // Print startup message to serial monitor
-    // Helps verify that the program is running correctly
-    // Useful for debugging initialization issues
-    Serial.println("ESP32-C3 Temperature Monitoring System with MQTT");
-    Serial.println("================================================");
-
-    // Initialize the DallasTemperature library
-    // This discovers connected DS18B20 sensors on the OneWire bus
-    // Must be called before attempting to read temperatures
-    sensors.begin();
-
-    // Print sensor information for debugging
-    Serial.print("Found ");
-    Serial.print(sensors.getDeviceCount(), DEC);
-    Serial.println(" DS18B20 sensor(s)");
-
-    // Initialize WiFi and MQTT connections
-    Serial.println("\nInitializing network connections...");
+    prepareWiFi();
+    wifiNetwork = network;
 
-    // Connect to WiFi
-    if (connectToWiFi())
+    if (fastPath)
     {
-        // WiFi connected successfully, now connect to MQTT
-        connectToMQTT();
+        WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                    IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
     }
     else
     {
-        Serial.println("WiFi connection failed. MQTT will be disabled.");
-        Serial.println("Please check your WiFi credentials in the code.");
+        // All zero addresses switch back to DHCP
+        WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
     }
 
-    Serial.println("Setup complete!");
-    Serial.println("================================================");
+    // WiFi connect
+    const WiFiNetwork& credentials = wifiNetworks[network];
+    if (POWER_SAVE_MODE)
+    {
+        // Store the credentials without connecting so the listen interval
+        // can be set before associating
+        WiFi.begin(credentials.ssid, credentials.password, channel, bssid, false);
+        configureModemSleep();
+        esp_wifi_connect();
+    }
+    else
+    {
+        WiFi.begin(credentials.ssid, credentials.password, channel, bssid);
+    }
 }
 
 //
-// Main program loop - runs continuously after setup
+// Find a configured network by SSID
+// Returns the index in wifiNetworks or -1
 //
-// This function implements the core temperature monitoring logic:
-// - Maintains precise 1-second sampling intervals
-// - Collects temperature readings from DS18B20 sensor
-// - Publishes current temperature to MQTT
-// - Provides real-time feedback via serial output
+int findWiFiNetwork(const char* ssid)
+{
+    for (uint8_t i = 0; i < WIFI_NETWORK_COUNT; i++)
+    {
+        if (strcmp(wifiNetworks[i].ssid, ssid) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 //
-// The loop uses non-blocking timing to ensure consistent sampling
-// without interfering with other potential system operations.
+// Start the fast path to the cached network
+// Returns false if there is no cached connection to a configured network
 //
-void loop(void)
+bool beginCachedWiFi()
+{
+    int network = wifiCache.magic == WIFI_CACHE_MAGIC ? findWiFiNetwork(wifiCache.ssid) : -1;
+    if (network < 0)
+    {
+        return false;
+    }
+    beginWiFi(network, wifiCache.channel, wifiCache.bssid, true);
+    return true;
+}
+
+//
+// Rank the configured networks by the results of the last scan
+// Networks found are ordered by the RSSI of their strongest access point,
+// networks not found follow in the configured order
+//
+void rankWiFiCandidates()
+{
+    int16_t found = WiFi.scanComplete();
+    wifiCandidateCount = 0;
+
+    for (uint8_t network = 0; network < WIFI_NETWORK_COUNT; network++)
+    {
+        WiFiCandidate candidate = {};
+        candidate.network = network;
+        candidate.rssi = INT8_MIN;
+        for (int16_t i = 0; i < found; i++)
+        {
+            if (WiFi.SSID(i) == wifiNetworks[network].ssid && (candidate.channel == 0 || WiFi.RSSI(i) > candidate.rssi))
+            {
+                memcpy(candidate.bssid, WiFi.BSSID(i), sizeof(candidate.bssid));
+                candidate.channel = WiFi.channel(i);
+                candidate.rssi = WiFi.RSSI(i);
+            }
+        }
+
+        // Insert by RSSI, networks not seen have INT8_MIN and keep their order
+        uint8_t position = wifiCandidateCount;
+        while (position > 0 && wifiCandidates[position - 1].rssi < candidate.rssi)
+        {
+            wifiCandidates[position] = wifiCandidates[position - 1];
+            position--;
+        }
+        wifiCandidates[position] = candidate;
+        wifiCandidateCount++;
+    }
+    WiFi.scanDelete();
+}
+
+//
+// Start connecting to a ranked candidate
+//
+void beginWiFiCandidate(const WiFiCandidate& candidate)
+{
+    Serial.print("Connecting to WiFi ");
+    Serial.println(wifiNetworks[candidate.network].ssid);
+    beginWiFi(candidate.network, candidate.channel, candidate.channel != 0 ? candidate.bssid : NULL, false);
+}
+
+//
+// Wait for the connection started by beginWiFi()
+// Returns false once timeout milliseconds have passed since start
+//
+bool waitForWiFi(unsigned long start, unsigned long timeout)
+{
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        if (millis() - start >= timeout)
+        {
+            return false;
+        }
+        delay(10);
+    }
+    return true;
+}
+
+//
+// Log and cache a new WiFi connection
+//
+void completeWiFiConnection(unsigned long start)
+{
+    Serial.print("WiFi connected to ");
+    Serial.print(wifiNetworks[wifiNetwork].ssid);
+    Serial.print(" in ");
+    Serial.print(millis() - start);
+    Serial.println(wifiFastPath ? "ms (fast path)" : "ms");
+    TIMING_RECORD(STAGE_WIFI_CONNECT, (millis() - start) * 1000);
+    saveWiFiCache();
+    startTimeSync();
+}
+
+//
+// Complete a connection started by beginCachedWiFi(), blocking
+// Falls back from a failed or missing fast path to one scan and the ranked
+// networks, and caches the connection on success. Returns false if WiFi
+// is not up within timeout milliseconds after start
+//
+bool finishWiFiConnect(bool fastPath, unsigned long start, unsigned long timeout)
+{
+    wifiFastPath = fastPath && waitForWiFi(start, WIFI_FAST_CONNECT_TIMEOUT);
+    bool connected = wifiFastPath;
+    if (!connected)
+    {
+        if (fastPath)
+        {
+            Serial.println("WiFi fast connect failed, scanning");
+            wifiCache.magic = 0;
+            WiFi.disconnect();
+        }
+
+        prepareWiFi();
+        WiFi.scanNetworks();
+        rankWiFiCandidates();
+        for (uint8_t i = 0; i < wifiCandidateCount && !connected && millis() - start < timeout; i++)
+        {
+            beginWiFiCandidate(wifiCandidates[i]);
+            unsigned long candidateStart = millis();
+            connected = waitForWiFi(candidateStart, min((unsigned long)WIFI_CONNECT_TIMEOUT, timeout - (candidateStart - start)));
+            if (!connected)
+            {
+                WiFi.disconnect();
+            }
+        }
+    }
+    if (!connected)
+    {
+        return false;
+    }
+
+    completeWiFiConnection(start);
+    return true;
+}
+
+//
+// WiFi event handler
+// Runs in the WiFi event task, only records the event and wakes the
+// network task which advances the connection state machine
+//
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+    switch (event)
+    {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        linkState.fetch_or(LINK_EVENT_GOT_IP);
+        break;
+
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    {
+        // Disconnects requested by the state machine itself are not a loss
+        const wifi_event_sta_disconnected_t& disconnected = info.wifi_sta_disconnected;
+        if (disconnected.reason == WIFI_REASON_ASSOC_LEAVE)
+        {
+            return;
+        }
+
+        // Only events for the network being tried count, a late failure of
+        // the previous candidate must not abort the current one. Each
+        // network is tried once per attempt, so the SSID identifies it
+        const char* target = wifiNetworks[wifiNetwork.load()].ssid;
+        if (disconnected.ssid_len != strlen(target) || memcmp(disconnected.ssid, target, disconnected.ssid_len) != 0)
+        {
+            return;
+        }
+        linkState.fetch_or(LINK_EVENT_LOST);
+        break;
+    }
+
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+        linkState.fetch_or(LINK_EVENT_LOST);
+        break;
+
+    case ARDUINO_EVENT_WIFI_SCAN_DONE:
+        linkState.fetch_or(LINK_EVENT_SCAN_DONE);
+        break;
+
+    default:
+        return;
+    }
+
+    if (networkTaskHandle != NULL)
+    {
+        xTaskNotifyGive(networkTaskHandle);
+    }
+}
+
+//
+// Start the scan for the configured networks without waiting
+// Completion is reported by the scan done event
+//
+void startWiFiScan(unsigned long currentTime)
+{
+    linkState.fetch_and(~LINK_EVENTS);
+    wifiFastPath = false;
+    wifiState = WIFI_STATE_SCANNING;
+    wifiStepStart = currentTime;
+    prepareWiFi();
+    WiFi.scanNetworks(true);
+}
+
+//
+// Start connecting to the next ranked candidate of the current attempt
+// Returns false when all candidates have been tried
+//
+bool connectNextWiFiCandidate(unsigned long currentTime)
+{
+    if (wifiCandidateIndex >= wifiCandidateCount)
+    {
+        return false;
+    }
+
+    // Switch the event filter to the new network before clearing the
+    // events, a late failure of the previous candidate is then ignored
+    const WiFiCandidate& candidate = wifiCandidates[wifiCandidateIndex++];
+    wifiNetwork = candidate.network;
+    linkState.fetch_and(~LINK_EVENTS);
+    wifiState = WIFI_STATE_CONNECTING;
+    wifiStepStart = currentTime;
+    beginWiFiCandidate(candidate);
+    return true;
+}
+
+//
+// Step the TX power one level up or down within the configured bounds
+// Returns true if the power changed
+//
+bool stepTxPower(bool up)
+{
+    uint8_t level = 0;
+    while (level < TX_POWER_LEVEL_COUNT - 1 && txPowerLevels[level] < txPower)
+    {
+        level++;
+    }
+
+    wifi_power_t power = txPower;
+    if (up && level < TX_POWER_LEVEL_COUNT - 1 && txPowerLevels[level + 1] <= TX_POWER_MAX)
+    {
+        power = txPowerLevels[level + 1];
+    }
+    else if (!up && level > 0 && txPowerLevels[level - 1] >= TX_POWER_MIN)
+    {
+        power = txPowerLevels[level - 1];
+    }
+    if (power == txPower)
+    {
+        return false;
+    }
+
+    txPower = power;
+    WiFi.setTxPower(txPower);
+    Serial.print("TX power ");
+    Serial.print(txPower / 4.0, 2);
+    Serial.println(" dBm");
+    return true;
+}
+
+//
+// Run one step of the TX power controller while connected
+// Weak signal or failed publishes raise the power right away, a strong
+// signal lowers it after TX_POWER_STABLE_PERIODS clean intervals
+//
+void adjustTxPower(unsigned long currentTime)
+{
+    if (currentTime - lastTxPowerAdjust < TX_POWER_ADJUST_INTERVAL)
+    {
+        return;
+    }
+    lastTxPowerAdjust = currentTime;
+
+    txPowerRssi = WiFi.RSSI();
+    bool failed = publishFailures > 0;
+    publishFailures = 0;
+
+    if (failed || txPowerRssi < TX_POWER_RSSI_LOW)
+    {
+        txPowerStablePeriods = 0;
+        stepTxPower(true);
+    }
+    else if (txPowerRssi > TX_POWER_RSSI_HIGH)
+    {
+        if (++txPowerStablePeriods >= TX_POWER_STABLE_PERIODS)
+        {
+            txPowerStablePeriods = 0;
+            stepTxPower(false);
+        }
+    }
+    else
+    {
+        txPowerStablePeriods = 0;
+    }
+}
+
+//
+// Advance the WiFi connection state machine
+// Returns the time in milliseconds until it has to run again, WiFi events
+// wake the network task earlier
+//
+unsigned long maintainWiFi(unsigned long currentTime)
+{
+    // Take the events recorded since the last step
+    uint32_t events = linkState.fetch_and(~LINK_EVENTS) & LINK_EVENTS;
+    bool gotIp = (events & LINK_EVENT_GOT_IP) != 0;
+    bool lost = (events & LINK_EVENT_LOST) != 0;
+
+    switch (wifiState)
+    {
+    case WIFI_STATE_DISCONNECTED:
+        if ((long)(currentTime - wifiRetryTime) < 0)
+        {
+            return wifiRetryTime - currentTime;
+        }
+
+        // Try the cached network first, otherwise scan
+        wifiAttemptStart = currentTime;
+        linkState.fetch_and(~LINK_EVENTS);
+        if (beginCachedWiFi())
+        {
+            wifiFastPath = true;
+            wifiState = WIFI_STATE_CONNECTING;
+            wifiStepStart = currentTime;
+            return WIFI_FAST_CONNECT_TIMEOUT;
+        }
+        startWiFiScan(currentTime);
+        return WIFI_SCAN_TIMEOUT;
+
+    case WIFI_STATE_SCANNING:
+    {
+        unsigned long elapsed = currentTime - wifiStepStart;
+        if (!(events & LINK_EVENT_SCAN_DONE) && elapsed < WIFI_SCAN_TIMEOUT)
+        {
+            return WIFI_SCAN_TIMEOUT - elapsed;
+        }
+
+        // A timed out scan leaves all networks unranked, they are still
+        // tried in the configured order
+        rankWiFiCandidates();
+        wifiCandidateIndex = 0;
+        connectNextWiFiCandidate(currentTime);
+        return WIFI_CONNECT_TIMEOUT;
+    }
+
+    case WIFI_STATE_CONNECTING:
+    {
+        if (gotIp)
+        {
+            wifiState = WIFI_STATE_CONNECTED;
+            setLinkFlag(LINK_WIFI_UP, true);
+            recordReconnectAttempt(wifiBackoff, true, currentTime - wifiAttemptStart);
+            completeWiFiConnection(wifiAttemptStart);
+            lastTxPowerAdjust = currentTime;
+            txPowerStablePeriods = 0;
+
+            // Connect to MQTT right away
+            mqttRetryTime = currentTime;
+            return 0;
+        }
+
+        unsigned long elapsed = currentTime - wifiStepStart;
+        unsigned long timeout = wifiFastPath ? WIFI_FAST_CONNECT_TIMEOUT : WIFI_CONNECT_TIMEOUT;
+        if (!lost && elapsed < timeout)
+        {
+            return timeout - elapsed;
+        }
+
+        WiFi.disconnect();
+        if (wifiFastPath)
+        {
+            // Fall back to a scan within the same attempt
+            Serial.println("WiFi fast connect failed, scanning");
+            wifiCache.magic = 0;
+            startWiFiScan(currentTime);
+            return WIFI_SCAN_TIMEOUT;
+        }
+        if (connectNextWiFiCandidate(currentTime))
+        {
+            return WIFI_CONNECT_TIMEOUT;
+        }
+
+        // Every network failed, retry after the backoff
+        recordReconnectAttempt(wifiBackoff, false, currentTime - wifiAttemptStart);
+        stepTxPower(true);
+        unsigned long retryDelay = nextBackoffDelay(wifiBackoff);
+        Serial.print("WiFi connection failed, retrying in ");
+        Serial.print(retryDelay);
+        Serial.println("ms");
+        wifiState = WIFI_STATE_DISCONNECTED;
+        wifiRetryTime = currentTime + retryDelay;
+        return retryDelay;
+    }
+
+    case WIFI_STATE_CONNECTED:
+        if (lost)
+        {
+            Serial.println("WiFi disconnected!");
+            setLinkFlag(LINK_WIFI_UP | LINK_MQTT_UP, false);
+            // Drop the dead TCP connection so the next MQTT connect starts fresh
+            espClient.stop();
+            stepTxPower(true);
+            wifiState = WIFI_STATE_DISCONNECTED;
+            wifiRetryTime = currentTime;
+            return 0;
+        }
+        adjustTxPower(currentTime);
+        return NETWORK_POLL_INTERVAL;
+    }
+    return NETWORK_POLL_INTERVAL;
+}
+
+//
+// Queue an MQTT message for the network task
+// Never blocks; the message is dropped if the queue is full or MQTT is down
+//
+void queueMessage(const char* topic, const char* payload, bool retained)
+{
+    if (!isLinkUp(LINK_MQTT_UP))
+    {
+        return;
+    }
+
+    MqttMessage message;
+    strncpy(message.topic, topic, sizeof(message.topic) - 1);
+    message.topic[sizeof(message.topic) - 1] = '\0';
+    strncpy(message.payload, payload, sizeof(message.payload) - 1);
+    message.payload[sizeof(message.payload) - 1] = '\0';
+    message.retained = retained;
+    if (xQueueSend(messageQueue, &message, 0) == pdTRUE)
+    {
+        xTaskNotifyGive(networkTaskHandle);
+    }
+}
+
+//
+// Format the retained presence message for a sensor on <topic>/presence
+// "present" when discovered, "absent" once it has been removed
+//
+const char* formatPresenceTopic(const TemperatureSensor& sensor, char* topic, size_t size)
+{
+    snprintf(topic, size, "%s/presence", sensor.topic);
+    return topic;
+}
+
+//
+// Drop a presence topic from the pending "absent" list
+// The caller holds sensorTableMutex
+//
+void removeAbsentTopic(const char* topic)
+{
+    for (uint8_t i = 0; i < absentCount; i++)
+    {
+        if (strcmp(absentTopics[i], topic) == 0)
+        {
+            memmove(absentTopics[i], absentTopics[i + 1], (absentCount - i - 1) * sizeof(absentTopics[0]));
+            absentCount--;
+            return;
+        }
+    }
+}
+
+//
+// Publish the retained presence of the sensors
+// "present" for every sensor in the table, "absent" for the removed
+// sensors still pending. The topics are copied under the lock and
+// published after it, so a slow socket never holds up the acquisition
+// task. Removed sensors stay pending until their "absent" has been sent
+// Returns false if a publish failed
+//
+bool publishPresence()
+{
+    static char present[MAX_SENSORS][MQTT_TOPIC_MAX_LENGTH];
+    static char absent[MAX_SENSORS][MQTT_TOPIC_MAX_LENGTH];
+
+    xSemaphoreTake(sensorTableMutex, portMAX_DELAY);
+    uint8_t presentCount = sensorCount;
+    for (uint8_t i = 0; i < presentCount; i++)
+    {
+        formatPresenceTopic(sensorTable[i], present[i], sizeof(present[i]));
+    }
+    uint8_t pendingCount = absentCount;
+    memcpy(absent, absentTopics, pendingCount * sizeof(absentTopics[0]));
+    xSemaphoreGive(sensorTableMutex);
+
+    bool published = true;
+    for (uint8_t i = 0; i < presentCount && published; i++)
+    {
+        published = mqttClient.publish(present[i], "present", true);
+    }
+    uint8_t sent = 0;
+    while (published && sent < pendingCount)
+    {
+        published = mqttClient.publish(absent[sent], "absent", true);
+        sent += published ? 1 : 0;
+    }
+
+    // Removals queued meanwhile stay pending for the next announcement
+    xSemaphoreTake(sensorTableMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < sent; i++)
+    {
+        removeAbsentTopic(absent[i]);
+    }
+    xSemaphoreGive(sensorTableMutex);
+    return published;
+}
+
+//
+// Connect to MQTT broker
+// Returns true if connection is successful, false otherwise
+//
+bool connectToMQTT()
+{
+    TIMING_MICROS_BEGIN(connectStart);
+
+    // Set MQTT server details
+    mqttClient.setServer(mqtt_server, MQTT_PORT);
+    mqttClient.setCallback(mqttCallback);
+
+    // Room for a whole batch in one publish
+    if (BATCH_MODE)
+    {
+        mqttClient.setBufferSize(BATCH_BUFFER_SIZE);
+    }
+
+    Serial.print("Connecting to MQTT broker ");
+    Serial.print(mqtt_server);
+    Serial.print(":");
+    Serial.print(MQTT_PORT);
+
+    // Attempt to connect with client ID
+    unsigned long attemptStart = millis();
+    bool connected = mqttClient.connect(mqtt_server);
+    recordReconnectAttempt(mqttBackoff, connected, millis() - attemptStart);
+    TIMING_MICROS_END(STAGE_MQTT_CONNECT, connectStart);
+    if (connected)
+    {
+        Serial.println("\nMQTT connected!");
+
+        // Publish online status
+        mqttClient.publish(MQTT_TOPIC_STATUS, "online");
+
+        // Subscribe to the command topic for remote control
+        mqttClient.subscribe(MQTT_TOPIC_COMMAND);
+
+        // Announce the current sensors and the pending removals, changes
+        // while offline are caught up
+        presenceChanged = false;
+        if (!publishPresence())
+        {
+            presenceChanged = true;
+        }
+
+        setLinkFlag(LINK_MQTT_UP, true);
+        return true;
+    }
+    else
+    {
+        Serial.println("\nMQTT connection failed!");
+        Serial.print("Error code: ");
+        Serial.println(mqttClient.state());
+        setLinkFlag(LINK_MQTT_UP, false);
+        return false;
+    }
+}
+
+//
+// Format a ROM address as 16 uppercase hex digits
+// buffer must hold at least 17 characters
+//
+void formatAddress(const DeviceAddress address, char* buffer)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        buffer[i * 2] = hexDigits[address[i] >> 4];
+        buffer[i * 2 + 1] = hexDigits[address[i] & 0x0F];
+    }
+    buffer[16] = '\0';
+}
+
+//
+// Program a sensor's resolution and alarm registers
+// Writes TH, TL and the configuration register to the scratchpad only,
+// without Copy Scratchpad, so frequent changes do not wear the sensor EEPROM
+//
+void writeSensorConfig(TemperatureSensor& sensor, uint8_t resolution)
+{
+    OneWire& oneWire = oneWireBuses[sensor.bus];
+    oneWire.reset();
+    oneWire.select(sensor.address);
+    oneWire.write(DS18B20_CMD_WRITE_SCRATCHPAD);
+    oneWire.write((uint8_t)sensor.alarmHigh);
+    oneWire.write((uint8_t)sensor.alarmLow);
+    oneWire.write(((resolution - 9) << 5) | DS18B20_CONFIG_RESERVED_BITS);
+    oneWire.reset();
+
+    sensor.resolution = resolution;
+}
+
+//
+// Recalculate the conversion timing of each bus
+// A broadcast conversion is done when the slowest sensor on the bus is done,
+// so polling starts a little before the longest learned time of the sensors
+// converting at the bus's highest resolution
+//
+void updateConversionTime()
+{
+    for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+    {
+        busStates[bus].resolution = RESOLUTION_MIN;
+        busStates[bus].pollStartTime = 0;
+    }
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        const TemperatureSensor& sensor = sensorTable[i];
+        if (sensor.resolution > busStates[sensor.bus].resolution)
+        {
+            busStates[sensor.bus].resolution = sensor.resolution;
+        }
+    }
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        const TemperatureSensor& sensor = sensorTable[i];
+        OneWireBusState& busState = busStates[sensor.bus];
+        if (sensor.resolution != busState.resolution)
+        {
+            continue;
+        }
+
+        // Start polling 1/8 before the learned time, an unknown time (0)
+        // polls from the start of the conversion
+        uint16_t learned = sensor.conversionTimes[sensor.resolution - RESOLUTION_MIN];
+        unsigned long pollStart = learned - learned / 8;
+        if (pollStart > busState.pollStartTime)
+        {
+            busState.pollStartTime = pollStart;
+        }
+    }
+
+    for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+    {
+        busStates[bus].conversionTime = busSensors[bus].millisToWaitForConversion(busStates[bus].resolution);
+    }
+}
+
+//
+// Learn the conversion time measured on a bus
+// The bus reports done when its slowest sensor is done, so the time is
+// attributed to the sensors converting at the bus's highest resolution
+// and smoothed with a 1/4 weight moving average
+//
+void learnConversionTime(uint8_t bus, unsigned long measured)
+{
+    const OneWireBusState& busState = busStates[bus];
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        TemperatureSensor& sensor = sensorTable[i];
+        if (sensor.bus != bus || sensor.resolution != busState.resolution)
+        {
+            continue;
+        }
+
+        uint16_t& learned = sensor.conversionTimes[sensor.resolution - RESOLUTION_MIN];
+        if (learned == 0)
+        {
+            learned = measured;
+        }
+        else
+        {
+            learned = (int32_t)learned + ((int32_t)measured - (int32_t)learned) / 4;
+        }
+    }
+}
+
+//
+// Adaptive resolution controller
+// Drops to RESOLUTION_MIN while the temperature changes fast or a burst is
+// running, and climbs back one bit at a time once readings are stable
+// Returns the resolution to use for the next conversion
+//
+uint8_t selectResolution(TemperatureSensor& sensor, int16_t raw)
+{
+    bool fastChange = sensor.hasLastTemp && abs(raw - sensor.lastRaw) >= RESOLUTION_FAST_DELTA;
+    sensor.lastRaw = raw;
+    sensor.hasLastTemp = true;
+
+    if (burstSamplesRemaining > 0 || fastChange)
+    {
+        sensor.stableSamples = 0;
+        return RESOLUTION_MIN;
+    }
+
+    if (++sensor.stableSamples >= RESOLUTION_STABLE_SAMPLES && sensor.resolution < sensor.maxResolution)
+    {
+        sensor.stableSamples = 0;
+        return sensor.resolution + 1;
+    }
+    return sensor.resolution;
+}
+
+//
+// Validate a scratchpad read
+// Checks presence, CRC, the power-on reset value and the measurement range
+// and stores the temperature in 1/16 °C with undefined low bits cleared
+//
+ReadResult validateScratchPad(bool present, const uint8_t* scratchPad, int16_t& raw)
+{
+    bool allZeros = true;
+    bool allOnes = true;
+    for (uint8_t i = 0; i < 9; i++)
+    {
+        allZeros = allZeros && scratchPad[i] == 0x00;
+        allOnes = allOnes && scratchPad[i] == 0xFF;
+    }
+    if (!present || allZeros || allOnes)
+    {
+        return READ_DISCONNECTED;
+    }
+
+    if (OneWire::crc8(scratchPad, 8) != scratchPad[8])
+    {
+        return READ_CRC_ERROR;
+    }
+
+    raw = (int16_t)((scratchPad[1] << 8) | scratchPad[0]);
+    if (raw == DS18B20_POWER_ON_RAW && scratchPad[6] == DS18B20_POWER_ON_BYTE6)
+    {
+        return READ_POWER_ON_RESET;
+    }
+    if (raw < DS18B20_RAW_MIN || raw > DS18B20_RAW_MAX)
+    {
+        return READ_OUT_OF_RANGE;
+    }
+
+    // Bits below the configured resolution are undefined
+    uint8_t resolution = ((scratchPad[4] >> 5) & 0x03) + 9;
+    raw &= ~((1 << (12 - resolution)) - 1);
+    return READ_OK;
+}
+
+//
+// Read a sensor's temperature with CRC validation and bounded retries
+// Returns true and sets raw to the temperature in 1/16 °C on success
+// Failed reads are counted in the sensor's error counters
+//
+bool readSensorTemperature(TemperatureSensor& sensor, int16_t& raw)
+{
+    unsigned long startTime = millis();
+    ReadResult result = READ_DISCONNECTED;
+
+    for (uint8_t attempt = 0; attempt < READ_RETRY_LIMIT; attempt++)
+    {
+        if (attempt > 0)
+        {
+            if (millis() - startTime >= READ_RETRY_BUDGET)
+            {
+                break;
+            }
+            sensor.errors.retries++;
+        }
+
+        uint8_t scratchPad[9];
+        bool present = busSensors[sensor.bus].readScratchPad(sensor.address, scratchPad);
+        result = validateScratchPad(present, scratchPad, raw);
+
+        // Only bus errors are worth retrying, the other results would
+        // read back the same scratchpad
+        if (result != READ_DISCONNECTED && result != READ_CRC_ERROR)
+        {
+            break;
+        }
+    }
+
+    switch (result)
+    {
+    case READ_OK:
+        return true;
+    case READ_DISCONNECTED:
+        sensor.errors.disconnected++;
+        break;
+    case READ_CRC_ERROR:
+        sensor.errors.crcErrors++;
+        break;
+    case READ_POWER_ON_RESET:
+        // The sensor lost power and restored its EEPROM configuration,
+        // program the resolution again
+        sensor.errors.powerOnResets++;
+        writeSensorConfig(sensor, sensor.resolution);
+        break;
+    case READ_OUT_OF_RANGE:
+        sensor.errors.outOfRange++;
+        break;
+    }
+    sensor.errors.failedReads++;
+    return false;
+}
+
+//
+// Find a sensor in the table by bus and ROM address
+// Returns the table index or -1 if the sensor is not in the table
+//
+int findSensor(uint8_t bus, const DeviceAddress address)
+{
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        if (sensorTable[i].bus == bus && memcmp(sensorTable[i].address, address, sizeof(DeviceAddress)) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Look up the sampling schedule for a sensor
+// Returns the first rule matching the sensor's address and bus
+//
+const ScheduleRule& findScheduleRule(const char* addressText, uint8_t bus)
+{
+    const size_t ruleCount = sizeof(scheduleRules) / sizeof(scheduleRules[0]);
+    for (size_t i = 0; i < ruleCount; i++)
+    {
+        const ScheduleRule& rule = scheduleRules[i];
+        if ((rule.bus < 0 || rule.bus == bus) &&
+            strncasecmp(addressText, rule.addressPrefix, strlen(rule.addressPrefix)) == 0)
+        {
+            return rule;
+        }
+    }
+    return scheduleRules[ruleCount - 1];
+}
+
+//
+// Initialize a sensor table entry for a sensor found on a bus
+// The sensor gets its own topic: MQTT_TOPIC_TEMPERATURE/<ROM address>
+//
+void initSensor(TemperatureSensor& sensor, uint8_t bus, const DeviceAddress address)
+{
+    memcpy(sensor.address, address, sizeof(DeviceAddress));
+    sensor.bus = bus;
+
+    char addressText[17];
+    formatAddress(sensor.address, addressText);
+    snprintf(sensor.topic, sizeof(sensor.topic), "%s/%s", MQTT_TOPIC_TEMPERATURE, addressText);
+
+    // Keep the alarm registers so config writes preserve them
+    // TH/TL are only taken from a scratchpad that passed the presence and
+    // CRC checks, a freshly plugged probe may still bounce. The temperature
+    // itself does not matter here, a power-on or out of range value still
+    // comes with valid alarm registers
+    sensor.alarmHigh = DS18B20_DEFAULT_ALARM_HIGH;
+    sensor.alarmLow = DS18B20_DEFAULT_ALARM_LOW;
+    for (uint8_t attempt = 0; attempt < READ_RETRY_LIMIT; attempt++)
+    {
+        uint8_t scratchPad[9];
+        int16_t raw;
+        bool present = busSensors[bus].readScratchPad(sensor.address, scratchPad);
+        ReadResult result = validateScratchPad(present, scratchPad, raw);
+        if (result != READ_DISCONNECTED && result != READ_CRC_ERROR)
+        {
+            sensor.alarmHigh = (int8_t)scratchPad[2];
+            sensor.alarmLow = (int8_t)scratchPad[3];
+            break;
+        }
+    }
+
+    // Apply the sampling schedule, a new sensor is due right away
+    const ScheduleRule& rule = findScheduleRule(addressText, bus);
+    sensor.interval = rule.interval;
+    sensor.maxResolution = constrain(rule.maxResolution, RESOLUTION_MIN, RESOLUTION_MAX);
+    sensor.nextSampleTime = millis();
+
+    // Start at full resolution, the controller lowers it when needed
+    sensor.stableSamples = 0;
+    sensor.hasLastTemp = false;
+    sensor.due = false;
+    sensor.selected = false;
+    sensor.missingPasses = 0;
+    memset(&sensor.errors, 0, sizeof(sensor.errors));
+    memset(sensor.conversionTimes, 0, sizeof(sensor.conversionTimes));
+    writeSensorConfig(sensor, sensor.maxResolution);
+
+    Serial.print("Sensor ");
+    Serial.print(addressText);
+    Serial.print(" on bus ");
+    Serial.print(bus);
+    Serial.print(", every ");
+    Serial.print(sensor.interval);
+    Serial.print("ms up to ");
+    Serial.print(sensor.maxResolution);
+    Serial.println("-bit");
+}
+
+//
+// Enumerate the buses once and fill the sensor table
+//
+void enumerateSensors()
+{
+    sensorCount = 0;
+    uint16_t deviceCount = 0;
+
+    for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+    {
+        DallasTemperature& sensors = busSensors[bus];
+        uint8_t busDeviceCount = sensors.getDeviceCount();
+        deviceCount += busDeviceCount;
+
+        for (uint8_t i = 0; i < busDeviceCount && sensorCount < MAX_SENSORS; i++)
+        {
+            DeviceAddress address;
+            if (!sensors.getAddress(address, i) || !sensors.validFamily(address))
+            {
+                continue;
+            }
+            initSensor(sensorTable[sensorCount++], bus, address);
+        }
+    }
+
+    if (deviceCount > MAX_SENSORS)
+    {
+        Serial.println("Warning: more sensors on the buses than MAX_SENSORS, extra sensors ignored");
+    }
+
+    updateConversionTime();
+}
+
+//
+// Apply the result of a completed discovery pass to the sensor table
+// The new table is built aside and copied in one step so acquisition never
+// sees a partially updated table
+//
+void applyDiscoveryResults()
+{
+    static TemperatureSensor newTable[MAX_SENSORS];
+    static char removedTopics[MAX_SENSORS][MQTT_TOPIC_MAX_LENGTH];
+    uint8_t newCount = 0;
+    uint8_t removedCount = 0;
+    bool changed = false;
+
+    // Keep sensors that were found, or have not been missing long enough
+    // An overflowing pass cannot tell missing sensors apart, so keep all
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        TemperatureSensor& sensor = sensorTable[i];
+        bool found = false;
+        for (uint8_t f = 0; f < discovery.foundCount && !found; f++)
+        {
+            found = discovery.foundBus[f] == sensor.bus &&
+                    memcmp(discovery.found[f], sensor.address, sizeof(DeviceAddress)) == 0;
+        }
+
+        if (found)
+        {
+            sensor.missingPasses = 0;
+        }
+        else if (!discovery.overflow && ++sensor.missingPasses >= DISCOVERY_MISSING_PASSES)
+        {
+            Serial.print("Sensor removed: ");
+            Serial.println(sensor.topic);
+            formatPresenceTopic(sensor, removedTopics[removedCount], sizeof(removedTopics[0]));
+            removedCount++;
+            changed = true;
+            continue;
+        }
+        newTable[newCount++] = sensor;
+    }
+
+    // Add sensors that are not in the table yet
+    uint8_t added = 0;
+    for (uint8_t f = 0; f < discovery.foundCount; f++)
+    {
+        if (findSensor(discovery.foundBus[f], discovery.found[f]) >= 0)
+        {
+            continue;
+        }
+        if (newCount >= MAX_SENSORS || added >= DISCOVERY_MAX_NEW_SENSORS)
+        {
+            break;
+        }
+
+        TemperatureSensor& sensor = newTable[newCount++];
+        initSensor(sensor, discovery.foundBus[f], discovery.found[f]);
+        added++;
+        changed = true;
+    }
+
+    if (changed)
+    {
+        xSemaphoreTake(sensorTableMutex, portMAX_DELAY);
+        memcpy(sensorTable, newTable, newCount * sizeof(TemperatureSensor));
+        sensorCount = newCount;
+
+        // A sensor plugged back in is no longer absent
+        char topic[MQTT_TOPIC_MAX_LENGTH];
+        for (uint8_t i = 0; i < newCount; i++)
+        {
+            removeAbsentTopic(formatPresenceTopic(sensorTable[i], topic, sizeof(topic)));
+        }
+        // More removals than MAX_SENSORS pending keeps the oldest ones
+        for (uint8_t i = 0; i < removedCount && absentCount < MAX_SENSORS; i++)
+        {
+            removeAbsentTopic(removedTopics[i]);
+            strcpy(absentTopics[absentCount++], removedTopics[i]);
+        }
+        xSemaphoreGive(sensorTableMutex);
+        updateConversionTime();
+
+        // Let the network task announce the change
+        presenceChanged = true;
+        if (networkTaskHandle != NULL)
+        {
+            xTaskNotifyGive(networkTaskHandle);
+        }
+
+        // New sensors need a full read to program their alarm band
+        fullSweepDone = false;
+    }
+}
+
+//
+// Run one step of the hot-plug discovery
+// Each call searches for at most one device, a pass over all buses is
+// started every DISCOVERY_INTERVAL
+//
+void discoveryStep(unsigned long currentTime)
+{
+    if (!discovery.active)
+    {
+        if (currentTime - lastDiscoveryTime < DISCOVERY_INTERVAL)
+        {
+            return;
+        }
+        lastDiscoveryTime = currentTime;
+        discovery.active = true;
+        discovery.overflow = false;
+        discovery.bus = 0;
+        discovery.foundCount = 0;
+        discoveryBuses[0].reset_search();
+    }
+
+    DeviceAddress address;
+    if (discoveryBuses[discovery.bus].search(address))
+    {
+        // Skip corrupted ROM codes and devices that are not temperature sensors
+        if (OneWire::crc8(address, 7) == address[7] && busSensors[discovery.bus].validFamily(address))
+        {
+            if (discovery.foundCount < MAX_SENSORS)
+            {
+                memcpy(discovery.found[discovery.foundCount], address, sizeof(DeviceAddress));
+                discovery.foundBus[discovery.foundCount] = discovery.bus;
+                discovery.foundCount++;
+            }
+            else
+            {
+                discovery.overflow = true;
+            }
+        }
+        return;
+    }
+
+    // Search on this bus is complete, continue with the next bus
+    if (++discovery.bus < ONE_WIRE_BUS_COUNT)
+    {
+        discoveryBuses[discovery.bus].reset_search();
+        return;
+    }
+
+    discovery.active = false;
+    applyDiscoveryResults();
+}
+
+//
+// Format a raw temperature in 1/16 °C as °C with one decimal
+// Integer only, rounds half away from zero (e.g. 0x0191 -> "25.1")
+// buffer must hold at least 8 characters, returns the string length
+//
+uint8_t formatTemperature(int16_t raw, char* buffer)
+{
+    char* out = buffer;
+    int32_t magnitude = raw;
+    if (magnitude < 0)
+    {
+        *out++ = '-';
+        magnitude = -magnitude;
+    }
+
+    // Tenths of a degree, rounded
+    uint16_t tenths = (uint16_t)((magnitude * 10 + 8) / 16);
+    uint16_t whole = tenths / 10;
+    if (tenths == 0)
+    {
+        // Do not print "-0.0"
+        out = buffer;
+    }
+
+    char digits[4];
+    uint8_t count = 0;
+    do
+    {
+        digits[count++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole > 0);
+    while (count > 0)
+    {
+        *out++ = digits[--count];
+    }
+
+    *out++ = '.';
+    *out++ = '0' + tenths % 10;
+    *out = '\0';
+    return out - buffer;
+}
+
+//
+// Publish readings as one binary message on MQTT_TOPIC_BINARY
+// At most BATCH_MAX_SAMPLES readings, recordFlags are added to every record
+// Returns true if the message was handed to the MQTT client
+//
+bool publishBinary(const TemperatureSample* samples, uint8_t count, uint8_t recordFlags)
+{
+    uint8_t payload[BINARY_PAYLOAD_MAX_LENGTH];
+
+    TIMING_CYCLES_BEGIN(formatStart);
+    PayloadHeader header;
+    header.version = PAYLOAD_VERSION;
+    header.flags = 0;
+    header.count = count;
+    if (!wallClockAt(samples[0].timestamp, header.base))
+    {
+        header.flags = PAYLOAD_FLAG_AGE;
+        header.base = millis() - samples[0].timestamp;
+    }
+    size_t length = payloadEncodeHeader(payload, header);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        PayloadRecord record;
+        memcpy(record.sensor, samples[i].address, sizeof(record.sensor));
+        record.offset = (int32_t)(samples[i].timestamp - samples[0].timestamp);
+        record.raw = samples[i].raw;
+        record.flags = ((samples[i].resolution - PAYLOAD_RECORD_RESOLUTION_MIN) & PAYLOAD_RECORD_RESOLUTION_MASK) | recordFlags;
+        length += payloadEncodeRecord(payload + length, record);
+    }
+    TIMING_CYCLES_END(STAGE_FORMAT, formatStart);
+
+    TIMING_MICROS_BEGIN(publishStart);
+    bool published = mqttClient.publish(MQTT_TOPIC_BINARY, payload, length);
+    TIMING_MICROS_END(STAGE_PUBLISH, publishStart);
+    return published;
+}
+
+//
+// Publish temperature data to MQTT broker
+// Publishes the temperature on the sensor's own topic and the resolution
+// it was measured with on <topic>/resolution
+// The temperature is formatted once for both the MQTT payload and the log
+// Returns true if the temperature was handed to the MQTT client
+//
+bool publishTemperatureData(const TemperatureSample& sample)
+{
+    // One binary record carries the resolution as well
+    if (BINARY_PAYLOAD)
+    {
+        return publishBinary(&sample, 1, 0);
+    }
+
+    char addressText[17];
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char temperature[8];
+    char payload[4]; // Resolution, "9" to "12"
+
+    TIMING_CYCLES_BEGIN(formatStart);
+    formatAddress(sample.address, addressText);
+    formatTemperature(sample.raw, temperature);
+    snprintf(topic, sizeof(topic), "%s/%s", MQTT_TOPIC_TEMPERATURE, addressText);
+    TIMING_CYCLES_END(STAGE_FORMAT, formatStart);
+
+    // Publish current temperature
+    TIMING_MICROS_BEGIN(publishStart);
+    bool published = mqttClient.publish(topic, temperature);
+    TIMING_MICROS_END(STAGE_PUBLISH, publishStart);
+    if (!published)
+    {
+        return false;
+    }
+
+    // Publish the resolution of this reading
+    snprintf(topic, sizeof(topic), "%s/%s/resolution", MQTT_TOPIC_TEMPERATURE, addressText);
+    snprintf(payload, sizeof(payload), "%u", sample.resolution);
+    mqttClient.publish(topic, payload);
+
+    // Log published temperature
+    Serial.print("Published to MQTT ");
+    Serial.print(addressText);
+    Serial.print(": ");
+    Serial.print(temperature);
+    Serial.print(" C (");
+    Serial.print(sample.resolution);
+    Serial.println("-bit)");
+    return true;
+}
+
+//
+// Publish a reading from the backlog on <topic>/history
+// Carries the wall clock time of the reading in milliseconds since the
+// epoch, or its age in milliseconds while the clock is not set, e.g.
+// {"temp":21.5,"resolution":12,"time":1700000000123}
+// Returns true if the reading was handed to the MQTT client
+//
+bool publishBacklogSample(const TemperatureSample& sample)
+{
+    if (BINARY_PAYLOAD)
+    {
+        return publishBinary(&sample, 1, PAYLOAD_RECORD_HISTORY);
+    }
+
+    char addressText[17];
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char temperature[8];
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+
+    formatAddress(sample.address, addressText);
+    formatTemperature(sample.raw, temperature);
+    snprintf(topic, sizeof(topic), "%s/%s/history", MQTT_TOPIC_TEMPERATURE, addressText);
+
+    uint64_t wallTime;
+    if (wallClockAt(sample.timestamp, wallTime))
+    {
+        snprintf(payload, sizeof(payload), "{\"temp\":%s,\"resolution\":%u,\"time\":%llu}",
+                 temperature, sample.resolution, (unsigned long long)wallTime);
+    }
+    else
+    {
+        snprintf(payload, sizeof(payload), "{\"temp\":%s,\"resolution\":%u,\"age\":%lu}",
+                 temperature, sample.resolution, (unsigned long)(millis() - sample.timestamp));
+    }
+    return mqttClient.publish(topic, payload);
+}
+
+//
+// Publish readings of any sensors as one message on MQTT_TOPIC_BATCH,
+// or on MQTT_TOPIC_BATCH/history for readings from the backlog
+// Each reading is [ROM, temperature, resolution, offset], the offset in
+// milliseconds from the first reading, whose wall clock time (or age
+// while the clock is not set) heads the message, e.g.
+// {"time":1700000000123,"samples":[["28FF0A1B2C3D4E5F",21.5,12,0],...]}
+// Returns true if the batch was handed to the MQTT client
+//
+bool publishBatch(const TemperatureSample* samples, uint8_t count, bool history)
+{
+    if (BINARY_PAYLOAD)
+    {
+        return publishBinary(samples, count, history ? PAYLOAD_RECORD_HISTORY : 0);
+    }
+
+    static char payload[BATCH_PAYLOAD_MAX_LENGTH];
+    char addressText[17];
+    char temperature[8];
+    size_t length;
+
+    TIMING_CYCLES_BEGIN(formatStart);
+    uint64_t wallTime;
+    if (wallClockAt(samples[0].timestamp, wallTime))
+    {
+        length = snprintf(payload, sizeof(payload), "{\"time\":%llu,\"samples\":[", (unsigned long long)wallTime);
+    }
+    else
+    {
+        length = snprintf(payload, sizeof(payload), "{\"age\":%lu,\"samples\":[",
+                          (unsigned long)(millis() - samples[0].timestamp));
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        formatAddress(samples[i].address, addressText);
+        formatTemperature(samples[i].raw, temperature);
+        length += snprintf(payload + length, sizeof(payload) - length, "%s[\"%s\",%s,%u,%ld]",
+                           i > 0 ? "," : "", addressText, temperature, samples[i].resolution,
+                           (long)(samples[i].timestamp - samples[0].timestamp));
+    }
+    snprintf(payload + length, sizeof(payload) - length, "]}");
+    TIMING_CYCLES_END(STAGE_FORMAT, formatStart);
+
+    TIMING_MICROS_BEGIN(publishStart);
+    bool published = mqttClient.publish(history ? MQTT_TOPIC_BATCH "/history" : MQTT_TOPIC_BATCH, payload);
+    TIMING_MICROS_END(STAGE_PUBLISH, publishStart);
+    if (published)
+    {
+        Serial.print("Published batch of ");
+        Serial.print(count);
+        Serial.println(" readings to MQTT");
+    }
+    return published;
+}
+
+//
+// Mount LittleFS for the backlog overflow and clear an old backlog file
+//
+void beginBacklogFlash()
+{
+    if (!LittleFS.begin(true))
+    {
+        Serial.println("LittleFS mount failed, backlog kept in RAM only");
+        return;
+    }
+    LittleFS.remove(BACKLOG_FILE);
+    backlogFlashReady = true;
+}
+
+//
+// Append a reading to the backlog file
+// Returns false if the file is full or cannot be written
+//
+bool appendBacklogFile(const TemperatureSample& sample)
+{
+    if (backlogFileRead + backlogFileCount >= BACKLOG_FILE_MAX_SAMPLES)
+    {
+        return false;
+    }
+
+    File file = LittleFS.open(BACKLOG_FILE, "a");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = file.write((const uint8_t*)&sample, sizeof(sample)) == sizeof(sample);
+    file.close();
+    if (written)
+    {
+        backlogFileCount++;
+    }
+    return written;
+}
+
+//
+// Refill the empty ring from the backlog file, oldest readings first
+// The file is removed once all its readings are back in RAM
+//
+void loadBacklogFile()
+{
+    size_t loaded = 0;
+    File file = LittleFS.open(BACKLOG_FILE, "r");
+    if (file)
+    {
+        file.seek(backlogFileRead * sizeof(TemperatureSample));
+        size_t wanted = min(backlogFileCount, (uint32_t)BACKLOG_LENGTH);
+        loaded = file.read((uint8_t*)backlog, wanted * sizeof(TemperatureSample)) / sizeof(TemperatureSample);
+        file.close();
+    }
+
+    backlogHead = 0;
+    backlogCount = loaded;
+    backlogFileRead += loaded;
+    backlogFileCount -= loaded;
+    if (loaded == 0 || backlogFileCount == 0)
+    {
+        // An unreadable file is given up
+        backlogDropped += backlogFileCount;
+        LittleFS.remove(BACKLOG_FILE);
+        backlogFileRead = 0;
+        backlogFileCount = 0;
+    }
+}
+
+//
+// Keep a reading that could not be published live in the backlog
+//
+void storeBacklogSample(const TemperatureSample& sample)
+{
+    if (backlogFlashReady && (backlogFileCount > 0 || backlogCount == BACKLOG_LENGTH))
+    {
+        if (!appendBacklogFile(sample))
+        {
+            backlogDropped++;
+        }
+        return;
+    }
+
+    if (backlogCount == BACKLOG_LENGTH)
+    {
+        // Drop the oldest reading
+        backlogHead = (backlogHead + 1) % BACKLOG_LENGTH;
+        backlogCount--;
+        backlogDropped++;
+    }
+    backlog[(backlogHead + backlogCount) % BACKLOG_LENGTH] = sample;
+    backlogCount++;
+}
+
+//
+// Publish the collected batch once it is full or its oldest reading is
+// BATCH_MAX_LATENCY old
+// Without MQTT, or if the publish fails, the readings go to the backlog
+// Returns the time in milliseconds until the batch is due
+//
+unsigned long flushBatch(unsigned long currentTime)
+{
+    if (batchCount == 0)
+    {
+        return BATCH_MAX_LATENCY;
+    }
+    bool mqttUp = isLinkUp(LINK_MQTT_UP);
+    unsigned long age = currentTime - batch[0].timestamp;
+    if (mqttUp && batchCount < BATCH_MAX_SAMPLES && age < BATCH_MAX_LATENCY)
+    {
+        return BATCH_MAX_LATENCY - age;
+    }
+
+    if (!mqttUp || !publishBatch(batch, batchCount, false))
+    {
+        if (mqttUp)
+        {
+            publishFailures++;
+        }
+        for (uint8_t i = 0; i < batchCount; i++)
+        {
+            storeBacklogSample(batch[i]);
+        }
+    }
+    batchCount = 0;
+    return BATCH_MAX_LATENCY;
+}
+
+//
+// Publish one batch of the backlog, oldest first
+// Called after the live readings have been published; a failed publish
+// leaves the reading in the backlog for the next step
+// Returns the time in milliseconds until the next step is due
+//
+unsigned long drainBacklog(unsigned long currentTime)
+{
+    if (backlogCount == 0 && backlogFileCount == 0)
+    {
+        return BACKLOG_DRAIN_INTERVAL;
+    }
+    unsigned long elapsed = currentTime - lastBacklogDrain;
+    if (elapsed < BACKLOG_DRAIN_INTERVAL)
+    {
+        return BACKLOG_DRAIN_INTERVAL - elapsed;
+    }
+    lastBacklogDrain = currentTime;
+
+    if (BATCH_MODE)
+    {
+        // The whole step in one message
+        if (backlogCount == 0)
+        {
+            loadBacklogFile();
+        }
+        TemperatureSample samples[BATCH_MAX_SAMPLES];
+        uint8_t count = min((uint16_t)min(BACKLOG_DRAIN_BATCH, BATCH_MAX_SAMPLES), backlogCount);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            samples[i] = backlog[(backlogHead + i) % BACKLOG_LENGTH];
+        }
+        if (count == 0)
+        {
+            return BACKLOG_DRAIN_INTERVAL;
+        }
+        if (!publishBatch(samples, count, true))
+        {
+            publishFailures++;
+            return BACKLOG_DRAIN_INTERVAL;
+        }
+        backlogHead = (backlogHead + count) % BACKLOG_LENGTH;
+        backlogCount -= count;
+        backlogDrained += count;
+        return BACKLOG_DRAIN_INTERVAL;
+    }
+
+    for (uint8_t i = 0; i < BACKLOG_DRAIN_BATCH && isLinkUp(LINK_MQTT_UP); i++)
+    {
+        if (backlogCount == 0)
+        {
+            if (backlogFileCount == 0)
+            {
+                break;
+            }
+            loadBacklogFile();
+            continue;
+        }
+        if (!publishBacklogSample(backlog[backlogHead]))
+        {
+            publishFailures++;
+            break;
+        }
+        backlogHead = (backlogHead + 1) % BACKLOG_LENGTH;
+        backlogCount--;
+        backlogDrained++;
+    }
+    return BACKLOG_DRAIN_INTERVAL;
+}
+
+//
+// Advance a sensor's schedule past the slot sampled at currentTime
+// The slot moves by whole intervals, so task wakeup jitter never
+// accumulates. Slots missed by a late cycle are skipped and counted, they
+// are not caught up. With the wall clock set the next slot is the next
+// interval boundary of the wall clock
+//
+void advanceSchedule(TemperatureSensor& sensor, unsigned long currentTime)
+{
+    // Burst samples between two slots leave the schedule alone
+    long untilSlot = (long)(sensor.nextSampleTime - currentTime);
+    if (untilSlot > SCHEDULE_COALESCE_WINDOW)
+    {
+        return;
+    }
+
+    // Slots missed by a late cycle, counted in both schedule modes
+    unsigned long skipped = untilSlot < 0 ? (unsigned long)(-untilSlot) / sensor.interval : 0;
+    sensor.errors.skippedSlots += skipped;
+
+    uint64_t wallTime;
+    if (wallClockAt(currentTime, wallTime))
+    {
+        // Next boundary after this slot, a slot sampled early within the
+        // coalesce window counts as its own boundary
+        unsigned long next = currentTime + sensor.interval - (unsigned long)(wallTime % sensor.interval);
+        if ((long)(next - currentTime) <= SCHEDULE_COALESCE_WINDOW)
+        {
+            next += sensor.interval;
+        }
+        sensor.nextSampleTime = next;
+        return;
+    }
+
+    sensor.nextSampleTime += (skipped + 1) * sensor.interval;
+}
+
+//
+// Mark the sensors that are due for sampling
+// Returns true if any sensor is due. Sensors falling due within
+// SCHEDULE_COALESCE_WINDOW are pulled into the same cycle so they share one
+// broadcast Convert T. A burst samples every sensor at BURST_SAMPLE_INTERVAL
+//
+bool selectDueSensors(unsigned long currentTime)
+{
+    if (burstSamplesRemaining > 0)
+    {
+        bool due = currentTime - lastBurstSampleTime >= BURST_SAMPLE_INTERVAL;
+        for (uint8_t i = 0; i < sensorCount; i++)
+        {
+            sensorTable[i].due = due;
+        }
+        if (due && sensorCount == 0)
+        {
+            // No sensor left to sample, the slot still counts so the burst
+            // ends and the wait time moves on
+            burstSamplesRemaining--;
+            lastBurstSampleTime = currentTime;
+            return false;
+        }
+        return due;
+    }
+
+    bool anyDue = false;
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        TemperatureSensor& sensor = sensorTable[i];
+        sensor.due = (long)(currentTime - sensor.nextSampleTime) >= 0;
+        anyDue = anyDue || sensor.due;
+    }
+    if (!anyDue)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        TemperatureSensor& sensor = sensorTable[i];
+        if (!sensor.due && (long)(sensor.nextSampleTime - currentTime) <= SCHEDULE_COALESCE_WINDOW)
+        {
+            sensor.due = true;
+        }
+    }
+    return true;
+}
+
+//
+// Start asynchronous temperature conversions for the due sensors
+// Every bus with a due sensor gets one broadcast Convert T, all buses
+// convert at the same time and the results are collected by
+// harvestNextReading()
+//
+void startTemperatureConversion(unsigned long currentTime)
+{
+    // In alarm search mode only due sensors outside their band are read,
+    // except for a periodic full sweep of every sensor; bursts always read
+    // every sensor
+    bool fullSweep = !ALARM_SEARCH_MODE || burstSamplesRemaining > 0 || !fullSweepDone ||
+                     currentTime - lastFullSweepTime >= FULL_SWEEP_INTERVAL;
+    if (fullSweep)
+    {
+        lastFullSweepTime = currentTime;
+        fullSweepDone = true;
+    }
+
+    for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+    {
+        busStates[bus].nextSensor = 0;
+        busStates[bus].converted = false;
+        busStates[bus].alarmSearchDone = fullSweep;
+        busStates[bus].pending = false;
+        oneWireBuses[bus].reset_search();
+    }
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        TemperatureSensor& sensor = sensorTable[i];
+        sensor.due = sensor.due || (ALARM_SEARCH_MODE && fullSweep);
+        sensor.selected = sensor.due && fullSweep;
+        if (!sensor.due)
+        {
+            continue;
+        }
+        advanceSchedule(sensor, currentTime);
+
+        OneWireBusState& busState = busStates[sensor.bus];
+        if (!busState.pending)
+        {
+            // With wait-for-conversion disabled this only issues the
+            // Convert T command and returns without blocking
+            busSensors[sensorTable[i].bus].requestTemperatures();
+            busState.pending = true;
+        }
+    }
+
+    if (burstSamplesRemaining > 0)
+    {
+        lastBurstSampleTime = currentTime;
+    }
+    conversionStartTime = currentTime;
+    acquisitionState = ACQ_CONVERTING;
+}
+
+//
+// Read, report and adapt the resolution of one sensor
+//
+void processReading(uint8_t index)
+{
+    TemperatureSensor& sensor = sensorTable[index];
+    uint8_t resolution = sensor.resolution;
+
+    // Read the scratchpad directly by ROM address, no bus search needed
+    // Invalid readings (no sensor, CRC error, power-on 85°C) are
+    // dropped so they never reach the published data
+    // The reading stays an integer in 1/16 °C all the way to the payload
+    int16_t raw;
+    TIMING_CYCLES_BEGIN(readStart);
+    bool valid = readSensorTemperature(sensor, raw);
+    TIMING_CYCLES_END(STAGE_READ, readStart);
+    if (!valid)
+    {
+        Serial.print("Sensor ");
+        Serial.print(index);
+        Serial.println(" read failed");
+        return;
+    }
+
+    // Log every accepted reading, also while offline
+    char temperature[8];
+    formatTemperature(raw, temperature);
+    Serial.print("Current temperature: ");
+    Serial.print(temperature);
+    Serial.print("°C (sensor ");
+    Serial.print(index);
+    Serial.print(", ");
+    Serial.print(resolution);
+    Serial.println("-bit)");
+
+    // Hand the reading to the network task for publishing, never blocks
+    // In battery mode there is no network task, the cycle drains the queue
+    TemperatureSample sample;
+    memcpy(sample.address, sensor.address, sizeof(DeviceAddress));
+    sample.timestamp = conversionStartTime;
+    sample.raw = raw;
+    sample.resolution = resolution;
+    // While offline the queue buffers the readings, the oldest reading
+    // is dropped when it is full
+    if (xQueueSend(sampleQueue, &sample, 0) != pdTRUE)
+    {
+        TemperatureSample oldest;
+        xQueueReceive(sampleQueue, &oldest, 0);
+        xQueueSend(sampleQueue, &sample, 0);
+    }
+    if (networkTaskHandle != NULL)
+    {
+        xTaskNotifyGive(networkTaskHandle);
+    }
+
+    // Select the resolution for the next conversion
+    uint8_t nextResolution = selectResolution(sensor, raw);
+    bool configChanged = nextResolution != sensor.resolution;
+
+    // Center the alarm band on the current reading
+    // The sensor flags an alarm when the integer part of the temperature
+    // (bits 11-4 of the raw value) reaches TH or drops to TL
+    if (ALARM_SEARCH_MODE)
+    {
+        int wholeDegrees = raw >> 4;
+        int8_t alarmHigh = constrain(wholeDegrees + ALARM_BAND, -55, 125);
+        int8_t alarmLow = constrain(wholeDegrees - ALARM_BAND, -55, 125);
+        configChanged = configChanged || alarmHigh != sensor.alarmHigh || alarmLow != sensor.alarmLow;
+        sensor.alarmHigh = alarmHigh;
+        sensor.alarmLow = alarmLow;
+    }
+
+    // Program the new configuration
+    // Only written when it changes, the bus is idle at this point
+    if (configChanged)
+    {
+        writeSensorConfig(sensor, nextResolution);
+    }
+}
+
+//
+// Finish the acquisition cycle once every bus has been read
+//
+void finishAcquisitionCycle()
+{
+    acquisitionState = ACQ_IDLE;
+
+    if (burstSamplesRemaining > 0)
+    {
+        burstSamplesRemaining--;
+    }
+    updateConversionTime();
+}
+
+//
+// Read the next converted temperature
+// Reads at most one sensor per call, taking the buses in turn so the reads
+// are interleaved across buses and each task iteration stays short
+//
+void harvestNextReading(unsigned long currentTime)
+{
+    bool anyPending = false;
+
+    for (uint8_t step = 1; step <= ONE_WIRE_BUS_COUNT; step++)
+    {
+        uint8_t bus = (lastReadBus + step) % ONE_WIRE_BUS_COUNT;
+        OneWireBusState& busState = busStates[bus];
+        if (!busState.pending)
+        {
+            continue;
+        }
+        anyPending = true;
+
+        // Wait until the conversion on this bus has finished
+        if (!busState.converted)
+        {
+            unsigned long elapsed = currentTime - conversionStartTime;
+            if (elapsed < busState.pollStartTime)
+            {
+                continue;
+            }
+
+            if (elapsed < busState.conversionTime)
+            {
+                // Poll the read time slot, the sensors send 0 while converting
+                if (busState.parasitePower || !oneWireBuses[bus].read_bit())
+                {
+                    continue;
+                }
+                learnConversionTime(bus, elapsed);
+            }
+            busState.converted = true;
+            TIMING_RECORD(STAGE_CONVERSION, elapsed * 1000);
+        }
+
+        // Alarm search, one device per step
+        // Selects the sensors whose temperature left their TH/TL band
+        if (!busState.alarmSearchDone)
+        {
+            DeviceAddress address;
+            if (oneWireBuses[bus].search(address, false))
+            {
+                int index = findSensor(bus, address);
+                if (index >= 0 && sensorTable[index].due)
+                {
+                    sensorTable[index].selected = true;
+                }
+            }
+            else
+            {
+                busState.alarmSearchDone = true;
+            }
+            lastReadBus = bus;
+            return;
+        }
+
+        // Find the next selected sensor on this bus
+        uint8_t index = busState.nextSensor;
+        while (index < sensorCount && (sensorTable[index].bus != bus || !sensorTable[index].selected))
+        {
+            index++;
+        }
+        if (index >= sensorCount)
+        {
+            busState.pending = false;
+            continue;
+        }
+
+        busState.nextSensor = index + 1;
+        lastReadBus = bus;
+        processReading(index);
+        return;
+    }
+
+    if (!anyPending)
+    {
+        finishAcquisitionCycle();
+    }
+}
+
+//
+// Time until the acquisition task has work to do, in milliseconds
+// While converting: the next poll window, poll or read step
+// While idle: the earliest due sensor or the next discovery step
+//
+unsigned long acquisitionWaitTime(unsigned long currentTime)
+{
+    if (acquisitionState == ACQ_CONVERTING)
+    {
+        unsigned long wait = ACQUISITION_STEP_INTERVAL;
+        bool converting = false;
+
+        for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+        {
+            const OneWireBusState& busState = busStates[bus];
+            if (!busState.pending)
+            {
+                continue;
+            }
+            if (busState.converted)
+            {
+                // Alarm search or reads pending on this bus
+                return ACQUISITION_STEP_INTERVAL;
+            }
+
+            // Next poll window, poll or timeout on this bus
+            unsigned long elapsed = currentTime - conversionStartTime;
+            unsigned long busWait;
+            if (elapsed < busState.pollStartTime)
+            {
+                busWait = busState.pollStartTime - elapsed;
+            }
+            else if (elapsed < busState.conversionTime && !busState.parasitePower)
+            {
+                busWait = min((unsigned long)CONVERSION_POLL_INTERVAL, busState.conversionTime - elapsed);
+            }
+            else if (elapsed < busState.conversionTime)
+            {
+                busWait = busState.conversionTime - elapsed;
+            }
+            else
+            {
+                busWait = 0;
+            }
+
+            wait = converting ? min(wait, busWait) : busWait;
+            converting = true;
+        }
+        return wait;
+    }
+
+    // Next discovery step, or the next discovery pass
+    // A due sample slot or burst still takes precedence below
+    unsigned long wait = DISCOVERY_STEP_INTERVAL;
+    if (!discovery.active)
+    {
+        unsigned long sinceDiscovery = currentTime - lastDiscoveryTime;
+        wait = sinceDiscovery >= DISCOVERY_INTERVAL ? 0 : DISCOVERY_INTERVAL - sinceDiscovery;
+    }
+
+    if (burstSamplesRemaining > 0)
+    {
+        unsigned long elapsed = currentTime - lastBurstSampleTime;
+        return elapsed >= BURST_SAMPLE_INTERVAL ? 0 : min(wait, BURST_SAMPLE_INTERVAL - elapsed);
+    }
+
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        long untilSlot = (long)(sensorTable[i].nextSampleTime - currentTime);
+        if (untilSlot <= 0)
+        {
+            return 0;
+        }
+        wait = min(wait, (unsigned long)untilSlot);
+    }
+    return wait;
+}
+
+//
+// Acquisition timer callback
+// Runs in the esp_timer task and wakes the acquisition task
+//
+void acquisitionTimerCallback(void* argument)
+{
+    xTaskNotifyGive(acquisitionTaskHandle);
+}
+
+//
+// Queue the reconnect statistics of one connection for publishing
+// e.g. {"attempts":3,"failures":2,"consecutive":0,"lastMs":412,"maxMs":10000,"backoffMs":2000}
+//
+void publishReconnectStats(const char* connection, const ReconnectBackoff& state)
+{
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s/%s", MQTT_TOPIC_RECONNECT, connection);
+    snprintf(payload, sizeof(payload),
+             "{\"attempts\":%lu,\"failures\":%lu,\"consecutive\":%lu,\"lastMs\":%lu,\"maxMs\":%lu,\"backoffMs\":%lu}",
+             (unsigned long)state.attempts, (unsigned long)state.failures,
+             (unsigned long)state.consecutiveFailures, (unsigned long)state.lastDuration,
+             (unsigned long)state.maxDuration, state.backoff);
+    queueMessage(topic, payload, false);
+}
+
+//
+// Queue the TX power controller state for publishing
+// e.g. {"txPowerQdBm":34,"rssi":-58}, the power in quarter dBm
+//
+void publishTxPowerReport()
+{
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    snprintf(payload, sizeof(payload), "{\"txPowerQdBm\":%d,\"rssi\":%d}", (int)txPower, (int)txPowerRssi);
+    queueMessage(MQTT_TOPIC_TX_POWER, payload, false);
+}
+
+//
+// Queue the store-and-forward backlog counters for publishing
+// e.g. {"ram":120,"flash":0,"drained":310,"dropped":0}
+//
+void publishBacklogReport()
+{
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    snprintf(payload, sizeof(payload), "{\"ram\":%u,\"flash\":%lu,\"drained\":%lu,\"dropped\":%lu}",
+             backlogCount, (unsigned long)backlogFileCount,
+             (unsigned long)backlogDrained, (unsigned long)backlogDropped);
+    queueMessage(MQTT_TOPIC_BACKLOG, payload, false);
+}
+
+#ifdef CONFIG_PM_PROFILING
+//
+// Read the light sleep time from the power management statistics
+// Both times are in microseconds since boot, totalTime covers all modes
+// Returns false if light sleep is not part of the statistics
+//
+bool readLightSleepTime(int64_t& sleepTime, int64_t& totalTime)
+{
+    char* text = NULL;
+    size_t size = 0;
+    FILE* stream = open_memstream(&text, &size);
+    if (stream == NULL)
+    {
+        return false;
+    }
+    esp_pm_dump_locks(stream);
+    fclose(stream);
+
+    // Mode lines are "<mode> <freq>M <time us> <percent>%", the lock
+    // lines and headers do not match this pattern
+    bool found = false;
+    sleepTime = 0;
+    totalTime = 0;
+    char* context = NULL;
+    for (char* line = strtok_r(text, "\n", &context); line != NULL; line = strtok_r(NULL, "\n", &context))
+    {
+        char mode[16];
+        int frequency;
+        long long time;
+        if (sscanf(line, "%15s %dM %lld", mode, &frequency, &time) == 3)
+        {
+            totalTime += time;
+            if (strcmp(mode, "SLEEP") == 0)
+            {
+                sleepTime = time;
+                found = true;
+            }
+        }
+    }
+    free(text);
+    return found;
+}
+#endif
+
+//
+// Queue the power report for publishing
+// Reports on MQTT_TOPIC_POWER, in per mille of the time since the last
+// report, how long firmware tasks were busy and, when the power management
+// statistics are available, how long the chip was actually in light sleep
+// e.g. {"lightSleep":true,"busyPermille":34,"sleepPermille":921}
+//
+void publishPowerReport()
+{
+    portENTER_CRITICAL(&awakeMux);
+    int64_t now = esp_timer_get_time();
+    int64_t awake = awakeTime;
+    if (awakeTasks > 0)
+    {
+        // Include the running awake period and restart it for the next report
+        awake += now - awakeSince;
+        awakeSince = now;
+    }
+    int64_t period = now - awakeReportStart;
+    awakeTime = 0;
+    awakeReportStart = now;
+    portEXIT_CRITICAL(&awakeMux);
+
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    int length = snprintf(payload, sizeof(payload), "{\"lightSleep\":%s,\"busyPermille\":%lu",
+                          acquisitionPmLock != NULL ? "true" : "false",
+                          (unsigned long)(period > 0 ? awake * 1000 / period : 1000));
+
+#ifdef CONFIG_PM_PROFILING
+    // Measured light sleep since the last report
+    static int64_t lastSleepTime = 0;
+    static int64_t lastTotalTime = 0;
+    int64_t sleepTime;
+    int64_t totalTime;
+    if (readLightSleepTime(sleepTime, totalTime) && totalTime > lastTotalTime)
+    {
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"sleepPermille\":%lu",
+                           (unsigned long)((sleepTime - lastSleepTime) * 1000 / (totalTime - lastTotalTime)));
+        lastSleepTime = sleepTime;
+        lastTotalTime = totalTime;
+    }
+#endif
+    snprintf(payload + length, sizeof(payload) - length, "}");
+    queueMessage(MQTT_TOPIC_POWER, payload, false);
+}
+
+#ifdef TIMING_INSTRUMENTATION
+//
+// Queue the timing histograms for publishing and reset them
+// One message per stage on MQTT_TOPIC_TIMING/<stage>, only the buckets
+// from the first to the last non-empty one are sent, e.g.
+// {"count":60,"maxUs":1290,"firstBucket":9,"buckets":[2,51,7]}
+//
+void publishTimingReport()
+{
+    TimingHistogram histograms[STAGE_COUNT];
+    portENTER_CRITICAL(&timingMux);
+    memcpy(histograms, timingHistograms, sizeof(histograms));
+    memset(timingHistograms, 0, sizeof(timingHistograms));
+    portEXIT_CRITICAL(&timingMux);
+
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        const TimingHistogram& histogram = histograms[stage];
+        if (histogram.count == 0)
+        {
+            continue;
+        }
+
+        uint8_t first = 0;
+        uint8_t last = TIMING_BUCKET_COUNT - 1;
+        while (histogram.buckets[first] == 0)
+        {
+            first++;
+        }
+        while (histogram.buckets[last] == 0)
+        {
+            last--;
+        }
+
+        int length = snprintf(payload, sizeof(payload), "{\"count\":%lu,\"maxUs\":%lu,\"firstBucket\":%u,\"buckets\":[",
+                              (unsigned long)histogram.count, (unsigned long)histogram.maxTime, first);
+        // Buckets that would not leave room for the closing are left out and
+        // flagged, so the message is always valid JSON
+        const char* closing = "]}";
+        const char* truncated = "],\"truncated\":true}";
+        for (uint8_t b = first; b <= last; b++)
+        {
+            char bucket[12];
+            int bucketLength = snprintf(bucket, sizeof(bucket), b == first ? "%lu" : ",%lu",
+                                        (unsigned long)histogram.buckets[b]);
+            if (length + bucketLength + (int)strlen(truncated) >= (int)sizeof(payload))
+            {
+                closing = truncated;
+                break;
+            }
+            memcpy(payload + length, bucket, bucketLength + 1);
+            length += bucketLength;
+        }
+        snprintf(payload + length, sizeof(payload) - length, "%s", closing);
+
+        snprintf(topic, sizeof(topic), "%s/%s", MQTT_TOPIC_TIMING, timingStageNames[stage]);
+        queueMessage(topic, payload, false);
+    }
+}
+#endif
+
+//
+// Queue the per-sensor diagnostics for publishing
+// Error counters are published as JSON on <topic>/errors and the learned
+// conversion times per resolution (0 = not learned yet) on <topic>/conversion
+//
+void publishSensorDiagnostics()
+{
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+
+    xSemaphoreTake(sensorTableMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < sensorCount; i++)
+    {
+        const TemperatureSensor& sensor = sensorTable[i];
+        snprintf(topic, sizeof(topic), "%s/errors", sensor.topic);
+        snprintf(payload, sizeof(payload),
+                 "{\"disconnected\":%lu,\"crc\":%lu,\"powerOnReset\":%lu,\"outOfRange\":%lu,\"retries\":%lu,\"failed\":%lu,\"skipped\":%lu}",
+                 (unsigned long)sensor.errors.disconnected,
+                 (unsigned long)sensor.errors.crcErrors,
+                 (unsigned long)sensor.errors.powerOnResets,
+                 (unsigned long)sensor.errors.outOfRange,
+                 (unsigned long)sensor.errors.retries,
+                 (unsigned long)sensor.errors.failedReads,
+                 (unsigned long)sensor.errors.skippedSlots);
+        queueMessage(topic, payload, false);
+
+        snprintf(topic, sizeof(topic), "%s/conversion", sensor.topic);
+        snprintf(payload, sizeof(payload), "{\"9\":%u,\"10\":%u,\"11\":%u,\"12\":%u}",
+                 sensor.conversionTimes[0], sensor.conversionTimes[1],
+                 sensor.conversionTimes[2], sensor.conversionTimes[3]);
+        queueMessage(topic, payload, false);
+    }
+    xSemaphoreGive(sensorTableMutex);
+}
+
+//
+// Maintain MQTT connection and handle reconnections
+// Works from the link state word; the MQTT client is only touched to
+// process incoming data, which also detects a lost session, or when the
+// reconnection timer has expired
+//
+void handleMQTTConnection()
 {
-    // Get current time in milliseconds since system start
-    // millis() provides a reliable timing reference
-    // Note: millis() overflows after ~50 days, but this is acceptable for this application
     unsigned long currentTime = millis();
+    uint32_t state = linkState.load();
+
+    // MQTT needs the WiFi connection, maintainWiFi() restores it
+    if (!(state & LINK_WIFI_UP))
+    {
+        return;
+    }
+
+    if (state & LINK_MQTT_UP)
+    {
+        // MQTT is connected, process any incoming messages
+        if (mqttClient.loop())
+        {
+            return;
+        }
+
+        // A lost session is retried after a randomized delay, so the
+        // devices do not all reconnect the moment a broker comes back
+        Serial.println("MQTT connection lost!");
+        setLinkFlag(LINK_MQTT_UP, false);
+        mqttRetryTime = currentTime + nextBackoffDelay(mqttBackoff);
+        return;
+    }
+
+    // Check if the next reconnection attempt is due
+    if ((long)(currentTime - mqttRetryTime) >= 0)
+    {
+        Serial.println("Attempting MQTT reconnection...");
+        if (connectToMQTT())
+        {
+            Serial.println("MQTT reconnected successfully!");
+        }
+        else
+        {
+            mqttRetryTime = millis() + nextBackoffDelay(mqttBackoff);
+        }
+    }
+}
+
+//
+// Acquisition task
+// Runs the temperature acquisition state machine and hot-plug discovery
+// Each step returns quickly; readings are handed to the network task
+// through sampleQueue so publishing never delays sampling
+//
+void acquisitionTask(void* parameter)
+{
+    for (;;)
+    {
+        markTaskAwake();
+        if (acquisitionPmLock != NULL)
+        {
+            esp_pm_lock_acquire(acquisitionPmLock);
+        }
+
+        // Get current time in milliseconds since system start
+        // Note: millis() overflows after ~50 days, the interval arithmetic
+        // is overflow safe
+        unsigned long currentTime = millis();
+
+        // Apply commands received over MQTT
+        AcquisitionCommand command;
+        while (xQueueReceive(commandQueue, &command, 0) == pdTRUE)
+        {
+            // A burst without sensors would have nothing to sample
+            if (command == CMD_BURST && sensorCount > 0)
+            {
+                burstSamplesRemaining = BURST_SAMPLE_COUNT;
+            }
+        }
+
+        // Run the temperature acquisition state machine
+        switch (acquisitionState)
+        {
+        case ACQ_IDLE:
+            // Check if any sensor is due for a new temperature sample
+            // A burst read shortens the interval until it has completed
+            if (selectDueSensors(currentTime))
+            {
+                // Start the conversion, the result is read in a later iteration
+                startTemperatureConversion(currentTime);
+            }
+            else
+            {
+                // Look for added or removed sensors while the buses are idle
+                discoveryStep(currentTime);
+            }
+            break;
+
+        case ACQ_CONVERTING:
+            // Harvest the results once the buses have finished converting
+            harvestNextReading(currentTime);
+            break;
+        }
+
+        // Sleep until the next deadline or a command arrives
+        unsigned long wait = acquisitionWaitTime(millis());
+        if (acquisitionPmLock != NULL)
+        {
+            esp_pm_lock_release(acquisitionPmLock);
+        }
+        markTaskAsleep();
+        if (wait > 0)
+        {
+            esp_timer_stop(acquisitionTimer);
+            esp_timer_start_once(acquisitionTimer, (uint64_t)wait * 1000);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+}
+
+//
+// Network task
+// Owns WiFi, the MQTT client and all publishing. The WiFi connection is
+// an event driven state machine; MQTT connection attempts only stall this
+// task, never the acquisition task
+//
+void networkTask(void* parameter)
+{
+    Serial.println("\nInitializing network connections...");
+
+    for (;;)
+    {
+        markTaskAwake();
+
+        // Advance the WiFi connection, never blocks
+        unsigned long wifiWait = maintainWiFi(millis());
+
+        // Handle MQTT connection maintenance
+        // Reconnects automatically if connection is lost
+        handleMQTTConnection();
+
+        // Announce sensors added or removed by discovery
+        if (isLinkUp(LINK_MQTT_UP) && presenceChanged.exchange(false) && !publishPresence())
+        {
+            presenceChanged = true;
+        }
+
+        // Publish the live readings first
+        // Readings that cannot be published go to the backlog, which is
+        // drained in batches between the live readings after a reconnect
+        // In batch mode a due batch is sent, or moved to the backlog when
+        // MQTT is down, before newer readings are handled
+        unsigned long batchWait = BATCH_MODE ? flushBatch(millis()) : BATCH_MAX_LATENCY;
+        TemperatureSample sample;
+        while (xQueueReceive(sampleQueue, &sample, 0) == pdTRUE)
+        {
+            if (!isLinkUp(LINK_MQTT_UP))
+            {
+                storeBacklogSample(sample);
+            }
+            else if (BATCH_MODE)
+            {
+                batch[batchCount++] = sample;
+                if (batchCount == BATCH_MAX_SAMPLES)
+                {
+                    batchWait = flushBatch(millis());
+                }
+            }
+            else if (!publishTemperatureData(sample))
+            {
+                publishFailures++;
+                storeBacklogSample(sample);
+            }
+        }
+        unsigned long backlogWait = isLinkUp(LINK_MQTT_UP) ? drainBacklog(millis()) : BACKLOG_DRAIN_INTERVAL;
+
+        MqttMessage message;
+        while (xQueueReceive(messageQueue, &message, 0) == pdTRUE)
+        {
+            if (isLinkUp(LINK_MQTT_UP))
+            {
+                if (!mqttClient.publish(message.topic, message.payload, message.retained))
+                {
+                    publishFailures++;
+                }
+            }
+        }
+
+        // Sleep until new readings or messages are queued or a WiFi event
+        // arrives, or until a timer is due: incoming MQTT data while
+        // connected, the MQTT reconnection, or a WiFi timeout or retry
+        uint32_t state = linkState.load();
+        unsigned long wait = max(wifiWait, 1UL);
+        if (state & LINK_MQTT_UP)
+        {
+            wait = min(wait, min((unsigned long)NETWORK_POLL_INTERVAL, min(backlogWait, batchWait)));
+        }
+        else if (state & LINK_WIFI_UP)
+        {
+            long untilRetry = (long)(mqttRetryTime - millis());
+            wait = min(wait, untilRetry > 0 ? (unsigned long)untilRetry + 1 : 1UL);
+        }
+        markTaskAsleep();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+    }
+}
+
+//
+// Housekeeping task
+// Low priority periodic work: sensor diagnostics and the power report
+//
+void housekeepingTask(void* parameter)
+{
+    for (;;)
+    {
+        markTaskAwake();
+        unsigned long currentTime = millis();
+
+        // Publish the sensor diagnostics and power report periodically
+        if (isLinkUp(LINK_MQTT_UP) && currentTime - lastDiagnosticsReport >= DIAGNOSTICS_INTERVAL)
+        {
+            lastDiagnosticsReport = currentTime;
+            publishSensorDiagnostics();
+            publishPowerReport();
+            publishReconnectStats("wifi", wifiBackoff);
+            publishReconnectStats("mqtt", mqttBackoff);
+            publishTxPowerReport();
+            publishBacklogReport();
+#ifdef TIMING_INSTRUMENTATION
+            publishTimingReport();
+#endif
+        }
+
+        // Sleep until the next report is due
+        unsigned long wait = HOUSEKEEPING_RETRY_INTERVAL;
+        unsigned long sinceReport = millis() - lastDiagnosticsReport;
+        if (isLinkUp(LINK_MQTT_UP) && sinceReport < DIAGNOSTICS_INTERVAL)
+        {
+            wait = DIAGNOSTICS_INTERVAL - sinceReport;
+        }
+        markTaskAsleep();
+        vTaskDelay(pdMS_TO_TICKS(wait));
+    }
+}
+
+#ifdef DEEP_SLEEP_MODE
+//
+// Restore the learned per-sensor state saved before the last deep sleep
+// Sensors still on the bus get back their resolution, alarm band,
+// conversion times and error counters; the bus is enumerated on every
+// wake so added and removed sensors are picked up
+//
+void restoreSensorState()
+{
+    for (uint8_t r = 0; r < rtcState.sensorCount; r++)
+    {
+        const TemperatureSensor& saved = rtcState.sensors[r];
+        int index = findSensor(saved.bus, saved.address);
+        if (index < 0)
+        {
+            continue;
+        }
+
+        TemperatureSensor& sensor = sensorTable[index];
+        uint8_t programmed = sensor.resolution;
+        sensor = saved;
+        if (saved.resolution != programmed)
+        {
+            writeSensorConfig(sensor, saved.resolution);
+        }
+    }
+    updateConversionTime();
+}
+
+//
+// Move this wake's readings from the sample queue to the RTC buffer
+// Timestamps are converted to milliseconds since power-on, the oldest
+// reading is dropped when the buffer is full
+//
+void storePendingSamples()
+{
+    TemperatureSample sample;
+    while (xQueueReceive(sampleQueue, &sample, 0) == pdTRUE)
+    {
+        sample.timestamp += rtcState.clock;
+        if (rtcState.pendingCount == RTC_PENDING_SAMPLES)
+        {
+            memmove(&rtcState.pending[0], &rtcState.pending[1],
+                    (RTC_PENDING_SAMPLES - 1) * sizeof(TemperatureSample));
+            rtcState.pendingCount--;
+            rtcState.samplesDropped++;
+        }
+        rtcState.pending[rtcState.pendingCount++] = sample;
+        rtcState.samplesTaken++;
+    }
+}
+
+//
+// Publish the pending readings, oldest first
+// Only readings of this wake are published as live readings, those kept
+// from earlier wakes go to the history topic with their sample time
+// Readings that could not be published stay pending for the next wake
+//
+void publishPendingSamples()
+{
+    uint8_t published = 0;
+    while (published < rtcState.pendingCount)
+    {
+        // Back to millis() of this wake for the timestamp in the payload,
+        // readings of earlier wakes wrap around to their past time
+        TemperatureSample sample = rtcState.pending[published];
+        sample.timestamp -= rtcState.clock;
+        bool earlierWake = (int32_t)sample.timestamp < 0;
+        if (!(earlierWake ? publishBacklogSample(sample) : publishTemperatureData(sample)))
+        {
+            break;
+        }
+        published++;
+    }
+
+    rtcState.pendingCount -= published;
+    memmove(&rtcState.pending[0], &rtcState.pending[published],
+            rtcState.pendingCount * sizeof(TemperatureSample));
+    rtcState.samplesPublished += published;
+}
+
+//
+// Publish the battery mode counters on MQTT_TOPIC_BATTERY
+// e.g. {"wakes":12,"taken":24,"published":22,"dropped":0,"pending":2,"awakeMs":812}
+//
+void publishBatteryReport()
+{
+    char payload[MQTT_PAYLOAD_MAX_LENGTH];
+    snprintf(payload, sizeof(payload),
+             "{\"wakes\":%lu,\"taken\":%lu,\"published\":%lu,\"dropped\":%lu,\"pending\":%u,\"awakeMs\":%lu}",
+             (unsigned long)rtcState.wakeCount, (unsigned long)rtcState.samplesTaken,
+             (unsigned long)rtcState.samplesPublished, (unsigned long)rtcState.samplesDropped,
+             rtcState.pendingCount, millis());
+    mqttClient.publish(MQTT_TOPIC_BATTERY, payload);
+}
 
-    // Handle MQTT connection maintenance
-    // This ensures WiFi and MQTT connections remain active
-    // Reconnects automatically if connection is lost
-    handleMQTTConnection();
+//
+// Run one battery mode cycle and enter deep sleep, never returns
+// wake -> convert -> connect -> publish -> deep sleep
+// WiFi associates while the sensors convert, readings that cannot be
+// published are kept in RTC memory and sent on a later wake
+//
+void runDeepSleepCycle()
+{
+    if (rtcState.magic != RTC_STATE_MAGIC)
+    {
+        // Power-on or reset, nothing retained
+        memset(&rtcState, 0, sizeof(rtcState));
+        rtcState.magic = RTC_STATE_MAGIC;
+    }
+    rtcState.wakeCount++;
+    restoreSensorState();
 
-    // Check if it's time to take a new temperature sample
-    // This implements a non-blocking delay mechanism
-    // Ensures exactly 1 sample per second regardless of processing time
-    if (currentTime - lastSampleTime >= SAMPLE_INTERVAL)
+    // Start the conversions of all sensors
+    for (uint8_t i = 0; i < sensorCount; i++)
     {
-        // Update timestamp for next interval calculation
-        lastSampleTime = currentTime;
+        sensorTable[i].due = true;
+    }
+    startTemperatureConversion(millis());
 
-        // Request temperature conversion from DS18B20 sensor
-        // This command initiates temperature measurement on the sensor
-        // The sensor requires time to perform the conversion (typically 750ms)
-        sensors.requestTemperatures();
+    // Connect while converting, through the fast path if possible
+    unsigned long connectStart = millis();
+    bool fastPath = beginCachedWiFi();
+
+    // Read the sensors as their buses finish converting
+    while (acquisitionState == ACQ_CONVERTING)
+    {
+        harvestNextReading(millis());
+        if (acquisitionState == ACQ_CONVERTING)
+        {
+            delay(acquisitionWaitTime(millis()));
+        }
+    }
+    storePendingSamples();
 
-        // Read temperature from first sensor (index 0)
-        // getTempCByIndex(0) returns temperature in Celsius
-        // Returns DEVICE_DISCONNECTED_C if sensor is not found
-        // Note: No error checking is implemented in current version
-        float currentTemp = sensors.getTempCByIndex(0);
+    // Save the sensor table with the learned state
+    memcpy(rtcState.sensors, sensorTable, sensorCount * sizeof(TemperatureSensor));
+    rtcState.sensorCount = sensorCount;
 
-        // Print current temperature information to serial monitor
-        // Shows current temperature reading
-        // Useful for real-time monitoring and debugging
-        Serial.print("Current temperature: ");
-        Serial.print(currentTemp);
-        Serial.println(" C");
+    // Publish everything pending
+    if (finishWiFiConnect(fastPath, connectStart, WIFI_CONNECT_TIMEOUT))
+    {
+        if (connectToMQTT())
+        {
+            publishPendingSamples();
+            publishBatteryReport();
+            mqttClient.disconnect();
+        }
+    }
+    else
+    {
+        Serial.println("WiFi connection timed out, readings kept for the next wake");
+    }
+    WiFi.disconnect(true);
 
-        // Publish current temperature to MQTT if connected
-        // This allows external systems to receive real-time temperature data
-        if (mqttConnected)
+    // Sleep for the rest of the interval, or until the next interval
+    // boundary of the wall clock once it is set
+    uint32_t awake = millis();
+    uint32_t sleepTime = awake + DEEP_SLEEP_MIN_SLEEP < DEEP_SLEEP_INTERVAL ? DEEP_SLEEP_INTERVAL - awake : DEEP_SLEEP_MIN_SLEEP;
+    uint64_t wallTime;
+    if (wallClockAt(awake, wallTime))
+    {
+        sleepTime = DEEP_SLEEP_INTERVAL - (uint32_t)(wallTime % DEEP_SLEEP_INTERVAL);
+        if (sleepTime < DEEP_SLEEP_MIN_SLEEP)
         {
-            publishTemperatureData(currentTemp);
+            sleepTime += DEEP_SLEEP_INTERVAL;
         }
     }
-    delay(10);
-    // End of main loop iteration
-    // The loop will continue running indefinitely
-    // Next iteration will check timing and potentially take new sample
+    rtcState.clock += awake + sleepTime;
+
+    Serial.print("Deep sleep for ");
+    Serial.print(sleepTime);
+    Serial.println("ms");
+    Serial.flush();
+
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepTime * 1000);
+    esp_deep_sleep_start();
+}
+#endif
+
+//
+// Arduino setup function - runs once at startup
+//
+// Initializes all hardware components and prepares the system
+// for temperature monitoring operations.
+//
+// Initialization sequence:
+// 1. Configure serial communication for debugging/output
+// 2. Initialize the DallasTemperature library
+// 3. Verify sensor connection and readiness
+// 4. Create the queues and start the tasks
+//
+void setup(void)
+{
+    // Initialize serial communication at 115200 baud
+    // This allows for high-speed data transfer to serial monitor
+    // 115200 is a common baud rate for ESP32 debugging
+    Serial.begin(115200);
+
+    // Print startup message to serial monitor
+    // Helps verify that the program is running correctly
+    // Useful for debugging initialization issues
+    Serial.println("ESP32-C3 Temperature Monitoring System with MQTT");
+    Serial.println("================================================");
+
+    // Initialize the DallasTemperature library on every bus
+    // This discovers connected DS18B20 sensors on each OneWire bus
+    // Must be called before attempting to read temperatures
+    for (uint8_t bus = 0; bus < ONE_WIRE_BUS_COUNT; bus++)
+    {
+        oneWireBuses[bus].begin(oneWireBusPins[bus]);
+        discoveryBuses[bus].begin(oneWireBusPins[bus]);
+        busSensors[bus].setOneWire(&oneWireBuses[bus]);
+        busSensors[bus].begin();
+
+        // Use asynchronous conversions
+        // requestTemperatures() returns immediately and the acquisition task
+        // harvests the results once the conversion has completed
+        busSensors[bus].setWaitForConversion(false);
+
+        // Parasite powered sensors cannot signal completion on the bus,
+        // those buses wait for the datasheet conversion time instead
+        busStates[bus].parasitePower = busSensors[bus].isParasitePowerMode();
+
+        // Print sensor information for debugging
+        Serial.print("Found ");
+        Serial.print(busSensors[bus].getDeviceCount(), DEC);
+        Serial.print(" DS18B20 sensor(s) on GPIO");
+        Serial.println(oneWireBusPins[bus]);
+    }
+
+    // Build the sensor table once
+    // Readings are taken by ROM address so no bus search is done per read
+    // Also sets the conversion time for the initial resolution
+    enumerateSensors();
+
+    // Create the queues and the sensor table mutex
+    sampleQueue = xQueueCreate(SAMPLE_QUEUE_LENGTH, sizeof(TemperatureSample));
+    messageQueue = xQueueCreate(MESSAGE_QUEUE_LENGTH, sizeof(MqttMessage));
+    commandQueue = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(AcquisitionCommand));
+    sensorTableMutex = xSemaphoreCreateMutex();
+
+    // Last good connection for the WiFi fast path
+    loadWiFiCache();
+
+#ifdef DEEP_SLEEP_MODE
+    // Battery mode runs one cycle and sleeps, no tasks are started
+    runDeepSleepCycle();
+#endif
+
+    // The network task reconnects through its state machine, driven by
+    // the WiFi events
+    WiFi.setAutoReconnect(false);
+    WiFi.onEvent(onWiFiEvent);
+
+    // Flash overflow for the store-and-forward backlog
+    if (BACKLOG_FLASH_OVERFLOW)
+    {
+        beginBacklogFlash();
+    }
+
+    // Enable automatic light sleep in power saving mode
+    // The busy fraction is measured in both modes for comparison
+    awakeReportStart = esp_timer_get_time();
+    if (POWER_SAVE_MODE)
+    {
+        configurePowerSaving();
+    }
+
+    // Timer waking the acquisition task at its next deadline
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = acquisitionTimerCallback;
+    timerArgs.name = "acquisition";
+    esp_timer_create(&timerArgs, &acquisitionTimer);
+
+    // Start the tasks
+    // The network task is created first as the acquisition task notifies it
+    // The network task makes the initial WiFi and MQTT connection
+    xTaskCreate(networkTask, "network", NETWORK_TASK_STACK, NULL, NETWORK_TASK_PRIORITY, &networkTaskHandle);
+    xTaskCreate(acquisitionTask, "acquisition", ACQUISITION_TASK_STACK, NULL, ACQUISITION_TASK_PRIORITY, &acquisitionTaskHandle);
+    xTaskCreate(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK, NULL, HOUSEKEEPING_TASK_PRIORITY, NULL);
+
+    Serial.println("Setup complete!");
+    Serial.println("================================================");
+}
+
+//
+// Main program loop
+//
+// All work runs in the acquisition, network and housekeeping tasks, so the
+// Arduino loop task is not needed and deletes itself
+// In battery mode setup() never returns, the device wakes through a reset
+//
+void loop(void)
+{
+    vTaskDelete(NULL);
 }
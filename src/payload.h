@@ -0,0 +1,139 @@
+// Compact binary payload format
+//
+// Shared by the firmware (encoding) and the host decoder in tools/, so it
+// only depends on the C++ standard headers. All fields are little endian
+// and written byte by byte, the layout does not depend on the compiler's
+// struct packing
+//
+// Message = header followed by count records
+//
+// Header (PAYLOAD_HEADER_SIZE bytes):
+//   0      version   PAYLOAD_VERSION, decoders reject other versions
+//   1      flags     PAYLOAD_FLAG_AGE: base is an age, not a wall clock time
+//   2      count     Number of records
+//   3..10  base      uint64, time of the first record in milliseconds since
+//                    the epoch, or with PAYLOAD_FLAG_AGE its age in
+//                    milliseconds when the message was published
+//
+// Record (PAYLOAD_RECORD_SIZE bytes):
+//   0..7   sensor    ROM address of the DS18B20, family code first
+//   8..11  offset    int32, milliseconds after the first record
+//   12..13 raw       int16, temperature in 1/16 °C
+//   14     flags     Bits 0-1: resolution - 9 (9-12 bits)
+//                    PAYLOAD_RECORD_HISTORY: forwarded from the backlog
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PAYLOAD_VERSION 1
+#define PAYLOAD_HEADER_SIZE 11
+#define PAYLOAD_RECORD_SIZE 15
+#define PAYLOAD_MAX_RECORDS 255
+
+// Header flags
+#define PAYLOAD_FLAG_AGE 0x01
+
+// Record flags
+#define PAYLOAD_RECORD_RESOLUTION_MASK 0x03
+#define PAYLOAD_RECORD_RESOLUTION_MIN 9
+#define PAYLOAD_RECORD_HISTORY 0x04
+
+struct PayloadHeader
+{
+    uint8_t version;
+    uint8_t flags;
+    uint8_t count;
+    uint64_t base;
+};
+
+struct PayloadRecord
+{
+    uint8_t sensor[8];
+    int32_t offset;
+    int16_t raw;
+    uint8_t flags;
+};
+
+//
+// Write the low bytes of value, least significant first
+//
+inline void payloadPut(uint8_t* out, uint64_t value, uint8_t bytes)
+{
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+//
+// Read a little endian value of bytes length
+//
+inline uint64_t payloadGet(const uint8_t* in, uint8_t bytes)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+//
+// Encode the header, returns the bytes written
+//
+inline size_t payloadEncodeHeader(uint8_t* out, const PayloadHeader& header)
+{
+    out[0] = header.version;
+    out[1] = header.flags;
+    out[2] = header.count;
+    payloadPut(out + 3, header.base, 8);
+    return PAYLOAD_HEADER_SIZE;
+}
+
+//
+// Encode one record, returns the bytes written
+//
+inline size_t payloadEncodeRecord(uint8_t* out, const PayloadRecord& record)
+{
+    memcpy(out, record.sensor, sizeof(record.sensor));
+    payloadPut(out + 8, (uint32_t)record.offset, 4);
+    payloadPut(out + 12, (uint16_t)record.raw, 2);
+    out[14] = record.flags;
+    return PAYLOAD_RECORD_SIZE;
+}
+
+//
+// Decode and validate the header of a message of length bytes
+// Returns false for an unknown version or a length that does not match
+// the record count
+//
+inline bool payloadDecodeHeader(const uint8_t* in, size_t length, PayloadHeader& header)
+{
+    if (length < PAYLOAD_HEADER_SIZE || in[0] != PAYLOAD_VERSION)
+    {
+        return false;
+    }
+    header.version = in[0];
+    header.flags = in[1];
+    header.count = in[2];
+    header.base = payloadGet(in + 3, 8);
+    return length == PAYLOAD_HEADER_SIZE + (size_t)header.count * PAYLOAD_RECORD_SIZE;
+}
+
+//
+// Decode record index of a message validated by payloadDecodeHeader()
+//
+inline void payloadDecodeRecord(const uint8_t* in, uint8_t index, PayloadRecord& record)
+{
+    const uint8_t* data = in + PAYLOAD_HEADER_SIZE + (size_t)index * PAYLOAD_RECORD_SIZE;
+    memcpy(record.sensor, data, sizeof(record.sensor));
+    record.offset = (int32_t)(uint32_t)payloadGet(data + 8, 4);
+    record.raw = (int16_t)(uint16_t)payloadGet(data + 12, 2);
+    record.flags = data[14];
+}
+
+#endif
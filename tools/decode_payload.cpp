@@ -0,0 +1,152 @@
+// Reference decoder for the compact binary payload (src/payload.h)
+//
+// Prints one line per reading:
+//   <ROM> time=<ms since epoch>|age=<ms> temp=<°C> resolution=<bits> [history]
+//
+// Usage:
+//   decode_payload [file...]   Each file (or stdin) holds one raw message
+//   decode_payload -x          Messages as hex, one per line on stdin, e.g.
+//                              mosquitto_sub -t sensor3/bin -F %x | decode_payload -x
+//
+// Exits with 1 if any message is invalid
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/payload.h"
+
+//
+// Print the readings of one message
+// Returns false if the message is not a valid payload
+//
+static bool decodeMessage(const std::vector<uint8_t>& message)
+{
+    PayloadHeader header;
+    if (!payloadDecodeHeader(message.data(), message.size(), header))
+    {
+        fprintf(stderr, "invalid message (%zu bytes, version %d)\n",
+                message.size(), message.empty() ? -1 : message[0]);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < header.count; i++)
+    {
+        PayloadRecord record;
+        payloadDecodeRecord(message.data(), i, record);
+
+        for (uint8_t j = 0; j < sizeof(record.sensor); j++)
+        {
+            printf("%02X", record.sensor[j]);
+        }
+
+        // Age runs backwards: later readings are younger
+        if (header.flags & PAYLOAD_FLAG_AGE)
+        {
+            printf(" age=%lld", (long long)header.base - record.offset);
+        }
+        else
+        {
+            printf(" time=%llu", (unsigned long long)(header.base + record.offset));
+        }
+        printf(" temp=%.4f resolution=%d%s\n", record.raw / 16.0,
+               (record.flags & PAYLOAD_RECORD_RESOLUTION_MASK) + PAYLOAD_RECORD_RESOLUTION_MIN,
+               (record.flags & PAYLOAD_RECORD_HISTORY) ? " history" : "");
+    }
+    return true;
+}
+
+//
+// Read a whole stream as one raw message
+//
+static std::vector<uint8_t> readStream(FILE* stream)
+{
+    std::vector<uint8_t> message;
+    uint8_t buffer[512];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+    {
+        message.insert(message.end(), buffer, buffer + length);
+    }
+    return message;
+}
+
+//
+// Parse a line of hex digits, whitespace is ignored
+// Returns false on other characters or an odd number of digits
+//
+static bool parseHex(const std::string& line, std::vector<uint8_t>& message)
+{
+    std::string digits;
+    for (char c : line)
+    {
+        if (isxdigit((unsigned char)c))
+        {
+            digits += c;
+        }
+        else if (!isspace((unsigned char)c))
+        {
+            return false;
+        }
+    }
+    if (digits.size() % 2 != 0)
+    {
+        return false;
+    }
+
+    message.clear();
+    for (size_t i = 0; i < digits.size(); i += 2)
+    {
+        message.push_back((uint8_t)strtoul(digits.substr(i, 2).c_str(), NULL, 16));
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    bool valid = true;
+
+    if (argc == 2 && strcmp(argv[1], "-x") == 0)
+    {
+        // A message of PAYLOAD_MAX_RECORDS records is over 7600 hex digits,
+        // lines are read whole whatever their length
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            std::vector<uint8_t> message;
+            if (!parseHex(line, message))
+            {
+                fprintf(stderr, "invalid hex line\n");
+                valid = false;
+            }
+            else if (!message.empty())
+            {
+                valid = decodeMessage(message) && valid;
+            }
+        }
+    }
+    else if (argc == 1)
+    {
+        valid = decodeMessage(readStream(stdin));
+    }
+    else
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            FILE* file = fopen(argv[i], "rb");
+            if (file == NULL)
+            {
+                perror(argv[i]);
+                valid = false;
+                continue;
+            }
+            valid = decodeMessage(readStream(file)) && valid;
+            fclose(file);
+        }
+    }
+    return valid ? 0 : 1;
+}